@@ -0,0 +1,492 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+
+#define LIBR_IMPLEMENTATION
+#include "r.h"
+
+// a fake EWMH window manager driving xhook through synthetic focus changes:
+// each change alternates between windows mapping to the two layouts below so
+// that every change ends in a keymap hook, which is replaced by a script
+// writing the layout to a FIFO read back here
+
+#define LAYOUT_DEFAULT "code"
+#define LAYOUT_ENGLISH "us"
+
+// classes with a rule in the default config.h, the rest fall through to the
+// default layout after every rule has been tried
+static const char* english_classes[] = {
+    "nethack", "crawl", "oolite", "musescore", "devilutionx", "ecwolf",
+};
+
+#define OTHER_CLASSES 16
+
+struct options {
+    unsigned int windows, depth, rate, changes, burst;
+    const char* xhook;
+    const char* modes;
+};
+
+struct client {
+    Window frame, window;
+    int english;
+};
+
+struct bench {
+    Display* dpy;
+    Window root, wm;
+    Atom net_active_window;
+
+    struct client* clients;
+    size_t n;
+
+    char dir[64];
+    char fifo[96], log[96];
+    int fd; // the FIFO, read end
+};
+
+struct result {
+    size_t changes, missed;
+    double* latency; // ms
+    unsigned long roundtrips, events;
+    double cpu_ms;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    int r = clock_gettime(CLOCK_MONOTONIC, &ts); CHECK(r, "clock_gettime");
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts = {
+        .tv_sec = t / 1000000000,
+        .tv_nsec = t % 1000000000,
+    };
+    int r;
+    while((r = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+          == EINTR);
+    if(r != 0) {
+        failwith("clock_nanosleep: %s", strerror(r));
+    }
+}
+
+static void wm_init(struct bench* b)
+{
+    b->dpy = XOpenDisplay(NULL);
+    if(b->dpy == NULL) {
+        failwith("unable to open display: %s", XDisplayName(NULL));
+    }
+    b->root = DefaultRootWindow(b->dpy);
+
+    Atom check = XInternAtom(b->dpy, "_NET_SUPPORTING_WM_CHECK", False);
+    Atom supported = XInternAtom(b->dpy, "_NET_SUPPORTED", False);
+    b->net_active_window = XInternAtom(b->dpy, "_NET_ACTIVE_WINDOW", False);
+
+    b->wm = XCreateSimpleWindow(b->dpy, b->root, 0, 0, 1, 1, 0, 0, 0);
+    XChangeProperty(b->dpy, b->wm, check, XA_WINDOW, 32, PropModeReplace,
+                    (unsigned char*)&b->wm, 1);
+    XChangeProperty(b->dpy, b->root, check, XA_WINDOW, 32, PropModeReplace,
+                    (unsigned char*)&b->wm, 1);
+    XChangeProperty(b->dpy, b->root, supported, XA_ATOM, 32, PropModeReplace,
+                    (unsigned char*)&b->net_active_window, 1);
+}
+
+static void wm_deinit(struct bench* b)
+{
+    for(size_t i = 0; i < b->n; i++) {
+        XDestroyWindow(b->dpy, b->clients[i].frame);
+    }
+    XDestroyWindow(b->dpy, b->wm);
+    XCloseDisplay(b->dpy);
+    free(b->clients);
+}
+
+// every client sits depth-1 levels below a frame, half of them map to the
+// English layout
+static void clients_create(struct bench* b, const struct options* o)
+{
+    b->n = o->windows;
+    b->clients = calloc(b->n, sizeof(*b->clients));
+    CHECK_MALLOC(b->clients);
+
+    for(size_t i = 0; i < b->n; i++) {
+        struct client* c = &b->clients[i];
+        c->english = i % 2;
+
+        Window p = b->root;
+        unsigned int depth = 1 + rand() % o->depth;
+        for(unsigned int d = 0; d < depth; d++) {
+            Window w = XCreateSimpleWindow(b->dpy, p, 0, 0, 64, 64, 0, 0, 0);
+            if(d == 0) {
+                c->frame = w;
+            }
+
+            XClassHint h = { .res_name = "frame", .res_class = "bench-frame" };
+            char other[32], name[64];
+            if(d == depth - 1) {
+                if(c->english) {
+                    h.res_class = (char*)english_classes[
+                        rand() % LENGTH(english_classes)];
+                } else {
+                    snprintf(LIT(other), "bench-%u", rand() % OTHER_CLASSES);
+                    h.res_class = other;
+                }
+                h.res_name = h.res_class;
+                snprintf(LIT(name), "bench window %zu", i);
+                XStoreName(b->dpy, w, name);
+            }
+            XSetClassHint(b->dpy, w, &h);
+
+            XMapWindow(b->dpy, w);
+            p = c->window = w;
+        }
+    }
+
+    XSync(b->dpy, False);
+}
+
+static void focus(struct bench* b, const struct client* c)
+{
+    XSetInputFocus(b->dpy, c->window, RevertToParent, CurrentTime);
+    XChangeProperty(b->dpy, b->root, b->net_active_window, XA_WINDOW, 32,
+                    PropModeReplace, (unsigned char*)&c->window, 1);
+    XFlush(b->dpy);
+}
+
+static const struct client* pick(const struct bench* b, int english)
+{
+    while(1) {
+        const struct client* c = &b->clients[rand() % b->n];
+        if(english < 0 || c->english == english) {
+            return c;
+        }
+    }
+}
+
+static void hook_init(struct bench* b)
+{
+    strcpy(b->dir, "/tmp/xhook-bench.XXXXXX");
+    if(mkdtemp(b->dir) == NULL) {
+        failwith("mkdtemp: %s", strerror(errno));
+    }
+
+    snprintf(LIT(b->fifo), "%s/fifo", b->dir);
+    int r = mkfifo(b->fifo, 0600); CHECK(r, "mkfifo");
+
+    // opened read-write so that the hooks are never met by a closed FIFO
+    b->fd = open(b->fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    CHECK(b->fd, "open(%s)", b->fifo);
+
+    char keymap[96];
+    snprintf(LIT(keymap), "%s/keymap", b->dir);
+    FILE* f = fopen(keymap, "w");
+    CHECK_NOT(f, NULL, "fopen(%s)", keymap);
+    fprintf(f, "#!/bin/sh\necho \"$1\" >> \"%s\"\n", b->fifo);
+    r = fclose(f); CHECK(r, "fclose");
+    r = chmod(keymap, 0700); CHECK(r, "chmod");
+
+    snprintf(LIT(b->log), "%s/log", b->dir);
+}
+
+static void hook_deinit(struct bench* b)
+{
+    char keymap[96];
+    snprintf(LIT(keymap), "%s/keymap", b->dir);
+    unlink(keymap);
+    unlink(b->log);
+    close(b->fd);
+    unlink(b->fifo);
+    rmdir(b->dir);
+}
+
+// wait for the hook to be run with layout l, returns 0 on success
+static int hook_wait(struct bench* b, const char* l, uint64_t deadline)
+{
+    char buf[128];
+    size_t n = 0;
+    while(1) {
+        uint64_t t = now_ns();
+        if(t >= deadline) {
+            return 1;
+        }
+
+        struct pollfd p = { .fd = b->fd, .events = POLLIN };
+        int r = poll(&p, 1, (deadline - t) / 1000000 + 1);
+        if(r == -1 && errno == EINTR) continue;
+        CHECK(r, "poll");
+        if(r == 0) continue;
+
+        ssize_t s = read(b->fd, buf + n, sizeof(buf) - n - 1);
+        if(s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        CHECK(s, "read");
+        n += s;
+        buf[n] = 0;
+
+        char* nl;
+        while((nl = strchr(buf, '\n')) != NULL) {
+            *nl = 0;
+            int match = strcmp(buf, l) == 0;
+            n -= nl + 1 - buf;
+            memmove(buf, nl + 1, n + 1);
+            if(match) {
+                return 0;
+            }
+        }
+
+        if(n == sizeof(buf) - 1) {
+            n = 0;
+        }
+    }
+}
+
+static void hook_drain(struct bench* b)
+{
+    char buf[128];
+    while(read(b->fd, buf, sizeof(buf)) > 0);
+}
+
+static pid_t xhook_spawn(const struct bench* b, const struct options* o,
+                         int poll, int no_cache)
+{
+    pid_t pid = fork(); CHECK(pid, "fork");
+    if(pid != 0) {
+        return pid;
+    }
+
+    int fd = open(b->log, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    CHECK(fd, "open(%s)", b->log);
+    int r = dup2(fd, 1); CHECK(r, "dup2");
+    r = dup2(fd, 2); CHECK(r, "dup2");
+
+    char path[4096];
+    const char* p = getenv("PATH");
+    snprintf(LIT(path), "%s:%s", b->dir, p ? p : "/usr/bin:/bin");
+    r = setenv("PATH", path, 1); CHECK(r, "setenv");
+
+    char* argv[4];
+    size_t i = 0;
+    argv[i++] = (char*)o->xhook;
+    if(poll) argv[i++] = "-p";
+    if(no_cache) argv[i++] = "-C";
+    argv[i] = NULL;
+
+    execv(o->xhook, argv);
+    failwith("execv(%s): %s", o->xhook, strerror(errno));
+}
+
+// the stats xhook logs on shutdown
+static void xhook_stats(const struct bench* b, struct result* res)
+{
+    FILE* f = fopen(b->log, "r");
+    CHECK_NOT(f, NULL, "fopen(%s)", b->log);
+
+    char line[1024];
+    while(fgets(line, sizeof(line), f) != NULL) {
+        const char* s;
+        if((s = strstr(line, "stats: uptime=")) != NULL) {
+            const char* r = strstr(s, "roundtrips=");
+            if(r != NULL) {
+                sscanf(r, "roundtrips=%lu", &res->roundtrips);
+            }
+        } else if((s = strstr(line, "stats: focus events=")) != NULL) {
+            sscanf(s, "stats: focus events=%lu", &res->events);
+        }
+    }
+
+    fclose(f);
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double quantile(const double* xs, size_t n, double q)
+{
+    if(n == 0) return 0;
+    size_t i = q * n;
+    return xs[MIN(i, n - 1)];
+}
+
+static void run(struct bench* b, const struct options* o,
+                int poll, int no_cache, struct result* res)
+{
+    memset(res, 0, sizeof(*res));
+    res->latency = calloc(o->changes, sizeof(double));
+    CHECK_MALLOC(res->latency);
+
+    int english = 0;
+    focus(b, pick(b, english));
+    hook_drain(b);
+
+    pid_t pid = xhook_spawn(b, o, poll, no_cache);
+    if(hook_wait(b, LAYOUT_DEFAULT, now_ns() + 5000000000ULL) != 0) {
+        kill(pid, SIGKILL);
+        failwith("xhook did not apply the initial layout: see %s", b->log);
+    }
+
+    uint64_t period = 1000000000ULL / o->rate;
+    uint64_t t = now_ns() + period;
+    for(size_t i = 0; i < o->changes; i++) {
+        sleep_until(t);
+        t += period;
+        hook_drain(b);
+
+        for(unsigned int j = 1; j < o->burst; j++) {
+            focus(b, pick(b, -1));
+        }
+
+        english = !english;
+        focus(b, pick(b, english));
+        uint64_t t0 = now_ns();
+
+        const char* l = english ? LAYOUT_ENGLISH : LAYOUT_DEFAULT;
+        if(hook_wait(b, l, t0 + 2000000000ULL) != 0) {
+            res->missed += 1;
+            continue;
+        }
+        res->latency[res->changes++] = (now_ns() - t0) / 1e6;
+    }
+
+    int r = kill(pid, SIGTERM); CHECK(r, "kill");
+    int ws;
+    struct rusage ru;
+    r = wait4(pid, &ws, 0, &ru); CHECK(r, "wait4");
+    if(!WIFEXITED(ws) || WEXITSTATUS(ws) != 0) {
+        warning("xhook exited abnormally: status=%d (see %s)", ws, b->log);
+    }
+
+    res->cpu_ms = ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3
+        + ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+
+    xhook_stats(b, res);
+    qsort(res->latency, res->changes, sizeof(double), cmp_double);
+}
+
+static void report(const char* mode, const struct result* r)
+{
+    size_t n = r->changes + r->missed;
+    printf("%-14s %7zu %6zu %8.2f %8.2f %8.2f %8.2f %9.2f %9.1f\n",
+           mode, r->changes, r->missed,
+           quantile(r->latency, r->changes, 0.50),
+           quantile(r->latency, r->changes, 0.90),
+           quantile(r->latency, r->changes, 0.99),
+           r->changes ? r->latency[r->changes - 1] : 0,
+           n ? (double)r->roundtrips / n : 0,
+           n ? r->cpu_ms * 1e3 / n : 0);
+}
+
+static const struct {
+    const char* name;
+    int poll, no_cache;
+} modes[] = {
+    { "ewmh", 0, 0 },
+    { "ewmh-nocache", 0, 1 },
+    { "poll", 1, 0 },
+    { "poll-nocache", 1, 1 },
+};
+
+static void usage(const char* prog)
+{
+    dprintf(2, "usage: %s [-n WINDOWS] [-d DEPTH] [-r HZ] [-c CHANGES] "
+            "[-b BURST] [-x XHOOK] [-m MODE,...]\n", prog);
+    dprintf(2, "modes:");
+    for(size_t i = 0; i < LENGTH(modes); i++) {
+        dprintf(2, " %s", modes[i].name);
+    }
+    dprintf(2, "\n");
+}
+
+static int mode_selected(const struct options* o, const char* m)
+{
+    if(o->modes == NULL) {
+        return 1;
+    }
+
+    size_t l = strlen(m);
+    for(const char* p = o->modes; (p = strstr(p, m)) != NULL; p += l) {
+        if((p == o->modes || p[-1] == ',') && (p[l] == 0 || p[l] == ',')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    struct options o = {
+        .windows = 64,
+        .depth = 3,
+        .rate = 20,
+        .changes = 200,
+        .burst = 1,
+        .xhook = "./xhook",
+        .modes = NULL,
+    };
+
+    int c;
+    while((c = getopt(argc, argv, "n:d:r:c:b:x:m:h")) != -1) {
+        if(c == 'n') o.windows = atoi(optarg);
+        else if(c == 'd') o.depth = atoi(optarg);
+        else if(c == 'r') o.rate = atoi(optarg);
+        else if(c == 'c') o.changes = atoi(optarg);
+        else if(c == 'b') o.burst = atoi(optarg);
+        else if(c == 'x') o.xhook = optarg;
+        else if(c == 'm') o.modes = optarg;
+        else if(c == 'h') { usage(argv[0]); return 0; }
+        else { usage(argv[0]); return 1; }
+    }
+
+    if(o.windows < 2 || o.depth < 1 || o.rate < 1 || o.burst < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    srand(0);
+
+    struct bench b = { .fd = -1 };
+    wm_init(&b);
+    clients_create(&b, &o);
+    hook_init(&b);
+
+    printf("windows=%u depth=%u rate=%uHz changes=%u burst=%u\n",
+           o.windows, o.depth, o.rate, o.changes, o.burst);
+    printf("%-14s %7s %6s %8s %8s %8s %8s %9s %9s\n",
+           "mode", "changes", "missed", "p50(ms)", "p90(ms)", "p99(ms)",
+           "max(ms)", "rt/change", "cpu(us)/c");
+
+    for(size_t i = 0; i < LENGTH(modes); i++) {
+        if(!mode_selected(&o, modes[i].name)) {
+            continue;
+        }
+
+        struct result r;
+        run(&b, &o, modes[i].poll, modes[i].no_cache, &r);
+        report(modes[i].name, &r);
+        fflush(stdout);
+        free(r.latency);
+    }
+
+    hook_deinit(&b);
+    wm_deinit(&b);
+
+    return 0;
+}
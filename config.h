@@ -1,57 +1,79 @@
-layout_t DEFAULT = "code";
-layout_t ENGLISH = "us";
-layout_t SWEDISH = "se";
-layout_t TEXT = "text";
-layout_t CHESS = "chess";
-
-static layout_t select_layout(const struct state* st, const struct window* w)
-{
-    if(window_has_class(w, "chromium")) {
-        return DEFAULT;
-    }
-
-    if(window_has_class(w, "musescore")
-       || window_has_class(w, "BaldursGate")
-       || window_has_class(w, "Dwarf_Fortress")
-       || window_has_class(w, "nethack")
-       || window_has_class(w, "Stardew Valley")
-       || window_has_name(w, "Caesar III")
-       || window_has_class(w, "devilutionx")
-       || window_has_class(w, "ecwolf")
-       || window_has_class(w, "FTL.amd64")
-       || window_has_class(w, "Breach")
-       || window_has_class(w, "Chowdren")
-       || window_has_class(w, "cogmind.exe")
-       || window_has_class(w, "oolite")
-       || window_has_class(w, "crawl")
-       || window_has_class(w, "CoQ.x86_64")
-       || window_has_class(w, "dwarfort")
-       || window_has_name(w, "Risk of Rain")
-       || window_has_class(w, "beeps-escape")
-       || window_has_name(w, "UNDERTALE")
-       ) {
-        return ENGLISH;
-    }
-
-    if(window_has_class_rec(st, w, "scid")) {
-        return CHESS;
-    }
-    if(window_has_class_rec(st, w, "setup")) {
-        return ENGLISH;
-    }
-
-    if(window_has_class(w, "adom")) {
-        return "adom";
-    }
-
-    return DEFAULT;
-}
-
-static int hide_cursor(const struct state* st, const struct window* w)
-{
-    if(window_has_class(w, "feh")) {
-        return 1;
-    }
-
-    return 0;
-}
+// focus changes are acted upon once no further change has been seen for
+// focus_settle_ms, but at the latest after focus_settle_max events
+static const unsigned int focus_settle_ms = 30;
+static const unsigned int focus_settle_max = 16;
+
+// without an EWMH compliant window manager the focus is polled: every
+// poll_min_ms after a change, then backing off to poll_max_ms while the
+// focus stays put and (with XSS=1) no input is seen. Polling stops while
+// the screen saver is on, needs XSS=1
+static const unsigned int poll_min_ms = 20;
+static const unsigned int poll_max_ms = 2000;
+
+// hide the cursor after this long without pointer motion (0: never), needs
+// XInput2 support: build with XI=1
+static const unsigned int cursor_idle_ms = 0;
+
+// layouts are passed to keymap(1) when switched to
+static const char DEFAULT[] = "code";
+static const char ENGLISH[] = "us";
+static const char SWEDISH[] = "se";
+static const char TEXT[] = "text";
+static const char CHESS[] = "chess";
+
+static const layout_t default_layout = DEFAULT;
+
+// layouts switched in-process by uploading a keymap preloaded from the
+// server's XKB database at startup, the rest are passed to keymap(1)
+static const struct xkb_layout xkb_layouts[] = {
+    /* layout       keycodes    types   compat  symbols */
+    // { ENGLISH,   NULL,       NULL,   NULL,   "pc+us+inet(evdev)" },
+};
+
+// windows the hooks ignore: the focus stays with the window they belong to
+static const int skip_transient = 1; // WM_TRANSIENT_FOR set
+static const char* skip_window_types[] = {
+    "_NET_WM_WINDOW_TYPE_DIALOG",
+    "_NET_WM_WINDOW_TYPE_NOTIFICATION",
+    "_NET_WM_WINDOW_TYPE_SPLASH",
+    "_NET_WM_WINDOW_TYPE_UTILITY",
+};
+
+// the first matching rule with a layout decides the layout, the first
+// matching rule with hide_cursor set hides the cursor
+static const struct rule rules[] = {
+    /* match        pattern             layout      hide_cursor */
+    { CLASS,        "chromium",         DEFAULT },
+
+    { CLASS,        "musescore",        ENGLISH },
+    { CLASS,        "BaldursGate",      ENGLISH },
+    { CLASS,        "Dwarf_Fortress",   ENGLISH },
+    { CLASS,        "nethack",          ENGLISH },
+    { CLASS,        "Stardew Valley",   ENGLISH },
+    { NAME,         "Caesar III",       ENGLISH },
+    { CLASS,        "devilutionx",      ENGLISH },
+    { CLASS,        "ecwolf",           ENGLISH },
+    { CLASS,        "FTL.amd64",        ENGLISH },
+    { CLASS,        "Breach",           ENGLISH },
+    { CLASS,        "Chowdren",         ENGLISH },
+    { CLASS,        "cogmind.exe",      ENGLISH },
+    { CLASS,        "oolite",           ENGLISH },
+    { CLASS,        "crawl",            ENGLISH },
+    { CLASS,        "CoQ.x86_64",       ENGLISH },
+    { CLASS,        "dwarfort",         ENGLISH },
+    { NAME,         "Risk of Rain",     ENGLISH },
+    { CLASS,        "beeps-escape",     ENGLISH },
+    { NAME,         "UNDERTALE",        ENGLISH },
+
+    { CLASS_REC,    "scid",             CHESS },
+    { CLASS_REC,    "setup",            ENGLISH },
+
+    { CLASS,        "adom",             "adom" },
+
+    // games under Wine and Proton often only tell themselves apart by the
+    // executable: the basename of /proc/$_NET_WM_PID/exe, or its comm
+    // (at most 15 characters) when that is Wine's loader
+    // { EXE,       "Game.exe",         ENGLISH },
+
+    { CLASS,        "feh",              NULL,       1 },
+};
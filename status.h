@@ -0,0 +1,124 @@
+// the state xhook publishes per display, for status bars and such:
+// $XDG_RUNTIME_DIR/xhook-DISPLAY, a shared mapping guarded by a seqlock
+//
+//   const struct xhook_status* s = xhook_status_open(":0");
+//   struct xhook_status c;
+//   uint32_t seq = xhook_status_read(s, &c);
+//   ... use c.layout, c.class, c.name ...
+//   xhook_status_wait(s, seq); // sleep until the next update
+//
+// reading takes no system calls, waiting only the one futex wait
+
+#ifndef XHOOK_STATUS_H
+#define XHOOK_STATUS_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define XHOOK_STATUS_MAGIC 0x78686b31 // "xhk1"
+
+struct xhook_status {
+    uint32_t magic;
+    uint32_t seq; // odd while being written, the futex woken on updates
+    uint64_t generation; // the number of updates published
+
+    uint64_t window; // the active window, 0 when none
+    char class[128]; // the window's class (last WM_CLASS string)
+    char name[256];
+    char layout[64]; // empty until a layout has been applied
+};
+
+static inline int xhook_status_path(char* buf, size_t n, const char* display)
+{
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    if(dir == NULL || display == NULL) {
+        return -1;
+    }
+
+    int r = snprintf(buf, n, "%s/xhook-", dir);
+    if(r < 0 || (size_t)r >= n) {
+        return -1;
+    }
+    for(size_t i = r; *display != '\0'; i++, display++) {
+        if(i + 1 >= n) {
+            return -1;
+        }
+        buf[i] = *display == '/' ? '_' : *display;
+        buf[i + 1] = '\0';
+    }
+    return 0;
+}
+
+// NULL (and errno set) when xhook is not publishing for display
+static inline const struct xhook_status*
+xhook_status_open(const char* display)
+{
+    char path[4096];
+    if(xhook_status_path(path, sizeof(path), display) != 0) {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        return NULL;
+    }
+
+    void* p = mmap(NULL, sizeof(struct xhook_status), PROT_READ,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        return NULL;
+    }
+    return p;
+}
+
+static inline void xhook_status_close(const struct xhook_status* s)
+{
+    munmap((void*)s, sizeof(*s));
+}
+
+// a consistent copy of s, returns the sequence number it was taken at
+static inline uint32_t xhook_status_read(const struct xhook_status* s,
+                                         struct xhook_status* c)
+{
+    uint32_t seq;
+    for(;;) {
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) {
+            continue;
+        }
+
+        memcpy(c, s, sizeof(*c));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+
+    c->class[sizeof(c->class) - 1] = '\0';
+    c->name[sizeof(c->name) - 1] = '\0';
+    c->layout[sizeof(c->layout) - 1] = '\0';
+    return seq;
+}
+
+// block until s has moved on from seq (or a signal arrives)
+static inline void xhook_status_wait(const struct xhook_status* s,
+                                     uint32_t seq)
+{
+    while(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == seq) {
+        if(syscall(SYS_futex, &s->seq, FUTEX_WAIT, seq, NULL, NULL, 0) == -1
+           && errno == EINTR) {
+            return;
+        }
+    }
+}
+
+#endif
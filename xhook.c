@@ -1,665 +1,5456 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <libudev.h>
-#include <poll.h>
+#include <limits.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <X11/XKBlib.h>
 #include <X11/extensions/Xfixes.h>
 
+#ifndef USE_XCB
+#define USE_XCB 0
+#endif
+
+#if USE_XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#endif
+
+#ifndef USE_RANDR
+#define USE_RANDR 0
+#endif
+
+#if USE_RANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+
+#ifndef USE_XI
+#define USE_XI 0
+#endif
+
+#if USE_XI
+#include <X11/extensions/XInput2.h>
+#endif
+
+#ifndef USE_XSS
+#define USE_XSS 0
+#endif
+
+#if USE_XSS
+#include <X11/extensions/scrnsaver.h>
+#endif
+
 #define LIBR_IMPLEMENTATION
 #include "r.h"
+#include "status.h"
+
+#ifdef LOG_RING
+#include <sys/uio.h>
+
+// LOG_RING bytes of in-process log buffer: lines are formatted into the
+// ring and written out by logger_flush, called when idle, when the ring
+// is full, at exit and before failing
+static struct {
+    char buf[LOG_RING];
+    size_t head; // bytes written to the ring, ever
+    size_t tail; // bytes flushed to logger_fd, ever
+    pid_t pid;
+    time_t now;
+    char stamp[17];
+} log_ring;
+
+static void logger_flush(void)
+{
+    int e = errno; // failwith reports it after the flush
+    while(log_ring.tail < log_ring.head) {
+        size_t o = log_ring.tail % LOG_RING, n = log_ring.head - log_ring.tail;
+        struct iovec iov[2] = {
+            { .iov_base = log_ring.buf + o, .iov_len = MIN(n, LOG_RING - o) },
+            { .iov_base = log_ring.buf, .iov_len = n - MIN(n, LOG_RING - o) },
+        };
+        ssize_t w = writev(logger_fd, iov, iov[1].iov_len ? 2 : 1);
+        if(w < 0) {
+            if(errno == EINTR) continue;
+            abort();
+        }
+        log_ring.tail += w;
+    }
+    errno = e;
+}
+
+static void log_ring_write(const char* s, size_t n)
+{
+    if(log_ring.head - log_ring.tail + n > LOG_RING) {
+        logger_flush();
+    }
+
+    size_t o = log_ring.head % LOG_RING, m = MIN(n, LOG_RING - o);
+    memcpy(log_ring.buf + o, s, m);
+    memcpy(log_ring.buf, s + m, n - m);
+    log_ring.head += n;
+}
+
+// the timestamp of vlogger, formatted once a second
+static const char* log_ring_now(void)
+{
+    const time_t t = time(NULL);
+    if(t != log_ring.now) {
+        struct tm tm;
+        if(strftime(LIT(log_ring.stamp), "%Y%m%dT%H%M%SZ",
+                    gmtime_r(&t, &tm)) == 0) {
+            abort();
+        }
+        log_ring.now = t;
+    }
+    return log_ring.stamp;
+}
+
+__attribute__((format(printf, 4, 5)))
+static void log_ring_logger(const char* caller, const char* file,
+                            unsigned int line, const char* fmt, ...)
+{
+    if(log_ring.pid == 0) {
+        // children are expected to exec, so the pid is looked up once
+        log_ring.pid = getpid();
+        atexit(logger_flush);
+    }
+
+    char b[1024];
+    int n = snprintf(LIT(b), "%s:%d:%s:%s:%u ",
+                     log_ring_now(), log_ring.pid, caller, file, line);
+    if(n < 0) {
+        abort();
+    }
+    size_t h = MIN((size_t)n, sizeof(b) - 1);
+
+    va_list vl;
+    va_start(vl, fmt);
+    int m = vsnprintf(b + h, sizeof(b) - h, fmt, vl);
+    va_end(vl);
+    if(m < 0) {
+        abort();
+    }
+
+    size_t l = h + MIN((size_t)m, sizeof(b) - h - 1);
+    if(l == sizeof(b) - 1) {
+        b[l - 1] = '\n'; // truncated
+    }
+    log_ring_write(b, MIN(l, (size_t)LOG_RING));
+}
+
+// r.h's logging macros, routed through the ring
+#undef __r_log
+#define __r_log(level, format, ...) do { \
+    log_ring_logger(__extension__ __FUNCTION__, __extension__ __FILE__, \
+        __extension__ __LINE__, format "\n", ##__VA_ARGS__); \
+} while(0)
+
+#undef CHECK_IF
+#define CHECK_IF(cond, format, ...) do { \
+    if(cond) { \
+        logger_flush(); \
+        LIBR(failwith0)(__extension__ __FUNCTION__, __extension__ __FILE__, \
+            __extension__ __LINE__, 1, \
+            format "\n", ##__VA_ARGS__); \
+    } \
+} while(0)
+
+#undef failwith
+#define failwith(format, ...) do { \
+    logger_flush(); \
+    LIBR(failwith0)(__extension__ __FUNCTION__, __extension__ __FILE__, \
+        __extension__ __LINE__, 0, format "\n", ##__VA_ARGS__); \
+} while(0)
+#else
+static void logger_flush(void)
+{
+}
+#endif
 
 typedef const char* layout_t;
 
-static int handle_x11_error(Display* d, XErrorEvent* e)
-{
-    char buf[1024];
-    XGetErrorText(d, e->error_code, LIT(buf));
-    error("x11: %s", buf);
-    return 0;
-}
+// arena: strings that live as long as the process, never moved
+#define ARENA_BLOCK 4096
+
+struct arena_block {
+    struct arena_block* next;
+    size_t used, size;
+    char data[];
+};
+
+struct arena {
+    struct arena_block* head;
+    size_t allocated;
+};
+
+static void* arena_alloc(struct arena* a, size_t n)
+{
+    n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    struct arena_block* b = a->head;
+    if(b == NULL || b->size - b->used < n) {
+        size_t size = MAX(ARENA_BLOCK, n);
+        b = malloc(sizeof(*b) + size);
+        CHECK_MALLOC(b);
+        b->next = a->head;
+        b->used = 0;
+        b->size = size;
+        a->head = b;
+        a->allocated += size;
+    }
+
+    void* p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+static void arena_free(struct arena* a)
+{
+    struct arena_block* b = a->head;
+    while(b != NULL) {
+        struct arena_block* n = b->next;
+        free(b);
+        b = n;
+    }
+    *a = (struct arena){ 0 };
+}
+
+// slab: power of two sized chunks (SLAB_MIN up to MAX_STR bytes) carved out
+// of an arena and recycled through per size free lists
+#define SLAB_MIN 32
+#define SLAB_CLASSES 6
+
+struct slab {
+    void* free[SLAB_CLASSES];
+    struct arena arena;
+    size_t chunks, in_use;
+};
+
+static size_t slab_class(size_t n)
+{
+    size_t c = 0;
+    while(((size_t)SLAB_MIN << c) < n) c++;
+    if(c >= SLAB_CLASSES) {
+        failwith("slab: chunk too large: %zu", n);
+    }
+    return c;
+}
+
+static char* slab_alloc(struct slab* s, size_t n)
+{
+    size_t c = slab_class(n);
+    void* p = s->free[c];
+    if(p != NULL) {
+        s->free[c] = *(void**)p;
+    } else {
+        p = arena_alloc(&s->arena, (size_t)SLAB_MIN << c);
+        s->chunks += 1;
+    }
+    s->in_use += 1;
+    return p;
+}
+
+static void slab_free(struct slab* s, void* p, size_t n)
+{
+    size_t c = slab_class(n);
+    *(void**)p = s->free[c];
+    s->free[c] = p;
+    s->in_use -= 1;
+}
+
+// symbols: interned strings (class names, rule patterns) compared by id
+typedef uint32_t sym_t;
+#define SYM_NONE 0
+
+struct symtab {
+    const char** strs; // indexed by sym_t
+    uint32_t* hashes;
+    size_t n, cap;
+
+    sym_t* table; // open addressing, SYM_NONE marks an empty slot
+    size_t mask;
+
+    struct arena arena;
+};
+
+static uint32_t hash_mem(const char* s, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < n; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void symtab_init(struct symtab* t)
+{
+    *t = (struct symtab){ .n = 1, .cap = 64, .mask = 127 };
+
+    t->strs = calloc(t->cap, sizeof(*t->strs));
+    CHECK_MALLOC(t->strs);
+    t->hashes = calloc(t->cap, sizeof(*t->hashes));
+    CHECK_MALLOC(t->hashes);
+    t->table = calloc(t->mask + 1, sizeof(*t->table));
+    CHECK_MALLOC(t->table);
+
+    t->strs[SYM_NONE] = "";
+}
+
+static void symtab_free(struct symtab* t)
+{
+    free(t->strs);
+    free(t->hashes);
+    free(t->table);
+    arena_free(&t->arena);
+    *t = (struct symtab){ 0 };
+}
+
+static size_t symtab_slot(const struct symtab* t,
+                          const char* s, size_t n, uint32_t h)
+{
+    size_t j = h & t->mask;
+    while(t->table[j] != SYM_NONE) {
+        sym_t x = t->table[j];
+        if(t->hashes[x] == h
+           && strncmp(t->strs[x], s, n) == 0 && t->strs[x][n] == 0) {
+            break;
+        }
+        j = (j + 1) & t->mask;
+    }
+    return j;
+}
+
+static void symtab_grow(struct symtab* t)
+{
+    if(t->n == t->cap) {
+        t->cap *= 2;
+        t->strs = realloc(t->strs, t->cap * sizeof(*t->strs));
+        CHECK_MALLOC(t->strs);
+        t->hashes = realloc(t->hashes, t->cap * sizeof(*t->hashes));
+        CHECK_MALLOC(t->hashes);
+    }
+
+    if(2 * t->n > t->mask) {
+        free(t->table);
+        t->mask = 2 * t->mask + 1;
+        t->table = calloc(t->mask + 1, sizeof(*t->table));
+        CHECK_MALLOC(t->table);
+        for(sym_t x = 1; x < t->n; x++) {
+            size_t j = t->hashes[x] & t->mask;
+            while(t->table[j] != SYM_NONE) {
+                j = (j + 1) & t->mask;
+            }
+            t->table[j] = x;
+        }
+    }
+}
+
+static sym_t sym_intern(struct symtab* t, const char* s, size_t n)
+{
+    uint32_t h = hash_mem(s, n);
+    size_t j = symtab_slot(t, s, n, h);
+    if(t->table[j] != SYM_NONE) {
+        return t->table[j];
+    }
+
+    char* c = arena_alloc(&t->arena, n + 1);
+    memcpy(c, s, n);
+    c[n] = 0;
+
+    sym_t x = t->n++;
+    t->strs[x] = c;
+    t->hashes[x] = h;
+    t->table[j] = x;
+
+    symtab_grow(t);
+    return x;
+}
+
+// SYM_NONE if s was never interned
+static sym_t sym_find(const struct symtab* t, const char* s)
+{
+    size_t n = strlen(s);
+    return t->table[symtab_slot(t, s, n, hash_mem(s, n))];
+}
+
+static const char* sym_str(const struct symtab* t, sym_t x)
+{
+    return t->strs[x];
+}
+
+// requests against client windows, which may be gone by the time the
+// server gets to them: BadWindow errors in these serial ranges are expected
+#define X11_QUIET_RANGES 8
+
+struct x11_errors {
+    struct {
+        unsigned long first, last;
+    } quiet[X11_QUIET_RANGES];
+    size_t next;
+    size_t suppressed, reported;
+};
+
+// the handler is process-wide: the display is looked up among these
+static struct xhook* x11_errors_xhook;
+
+static struct x11_errors* x11_errors_of(const Display* d);
+
+static int handle_x11_error(Display* d, XErrorEvent* e)
+{
+    struct x11_errors* errs = x11_errors_of(d);
+    if(errs != NULL && e->error_code == BadWindow) {
+        for(size_t i = 0; i < X11_QUIET_RANGES; i++) {
+            if(e->serial >= errs->quiet[i].first
+               && e->serial <= errs->quiet[i].last) {
+                trace("x11: window %lu vanished (serial %lu)",
+                      e->resourceid, e->serial);
+                errs->suppressed += 1;
+                return 0;
+            }
+        }
+    }
+
+    char buf[1024];
+    XGetErrorText(d, e->error_code, LIT(buf));
+    error("x11: %s (request %u.%u, serial %lu, resource %lu)", buf,
+          e->request_code, e->minor_code, e->serial, e->resourceid);
+    if(errs != NULL) {
+        errs->reported += 1;
+    }
+    return 0;
+}
+
+// log2 buckets of microseconds: bucket i counts samples below 2^i us
+#define HISTOGRAM_BUCKETS 32
+
+struct histogram {
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count, sum_us, max_us;
+};
+
+struct stats {
+    uint64_t start; // CLOCK_MONOTONIC ns
+    uint64_t ready; // entering the event loop
+
+    // event arrival to resolve, resolve, rule evaluation, hook run and the
+    // sum of it all: focus event to layout switched
+    struct histogram settle, resolve, select, hook, focus_to_hook;
+
+    uint64_t roundtrips, spawns, xkb_switches, reconnects;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+    CHECK(r, "clock_gettime");
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void histogram_add(struct histogram* h, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    size_t i = 0;
+    while(i < HISTOGRAM_BUCKETS - 1 && us >= (1ULL << i)) i++;
+
+    h->buckets[i] += 1;
+    h->count += 1;
+    h->sum_us += us;
+    h->max_us = MAX(h->max_us, us);
+}
+
+// upper bound of the bucket holding the q-th quantile
+static uint64_t histogram_quantile(const struct histogram* h, double q)
+{
+    uint64_t n = 0, t = (uint64_t)(q * h->count);
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        n += h->buckets[i];
+        if(n > t) {
+            return MIN(1ULL << i, h->max_us);
+        }
+    }
+    return h->max_us;
+}
+
+struct ruleset {
+    // copies of the rules with the patterns and layouts interned: so that
+    // layouts compare equal by pointer across reloads
+    struct rule* rules;
+    size_t n;
+    layout_t default_layout;
+
+    unsigned int generation; // distinguishes reloaded rulesets
+    int recursive; // any CLASS_REC rules: decisions depend on ancestors
+    int exe; // any EXE rules: windows need their executable resolved
+
+    // exact CLASS, NAME and EXE patterns: their symbol indexes the first
+    // rule, rules with the same pattern are chained in order
+    sym_t* syms;
+    size_t* next;
+    size_t* by_class;
+    size_t* by_name;
+    size_t* by_exe;
+    size_t n_syms;
+
+    // rules that need to be evaluated one by one, in order
+    size_t* fallbacks;
+    size_t n_fallbacks;
+};
+
+struct xhook;
+
+#define XI_DEVICES 16
+#define XI_PENDING 8
+#define SKIP_TYPES_MAX 16
+#define HISTORY_SIZE 32
+
+// everything tracked for one display
+struct state {
+    struct xhook* x;
+    const char* name; // as passed to XOpenDisplay, NULL for $DISPLAY
+    const char* seat; // the seat whose keyboards are used on this display
+    char** env; // for hooks: the environment with DISPLAY set
+
+    Window active;
+    int ewmh;
+
+    // the connection broke: 1 until torn down, then 2 while reconnecting
+    int lost;
+
+    // command line options, mostly for benchmarking
+    struct {
+        int poll; // ignore the window manager and poll the input focus
+        int no_cache; // forget every window between focus changes
+    } opts;
+
+    // focus events coalesced while waiting for the focus to settle
+    struct {
+        unsigned int burst;
+        size_t events, dropped;
+        uint64_t t_first; // first event of the burst
+        uint64_t t_served; // focus event the hooks are running for
+    } focus;
+
+    // polling without an EWMH window manager: fast after a focus change or
+    // input, backing off while nothing happens
+    struct {
+        unsigned int period_ms;
+        int blanked; // the screen saver is on: not polling at all
+    } poll;
+
+    // recent focus transitions between the windows hooks ran for: the
+    // likely next window is resolved while waiting for the focus to settle
+    struct {
+        struct {
+            Window from, to;
+        } ring[HISTORY_SIZE];
+        size_t head, n;
+        Window last; // the window hooks last ran for
+        Window predicted; // for the burst in progress, None if not
+        size_t predictions, hits;
+    } history;
+
+    // keyboards added since the layout was last applied
+    unsigned int relayout;
+
+    // the cursor is hidden while the focused window asks for it, or while
+    // the pointer is idle
+    struct {
+        Window window; // hidden for this window, None if not
+        int idle;
+        int hidden; // hidden on root
+        Window root;
+#if USE_XI
+        int tfd; // idle timer, -1 when disabled
+        uint64_t motion; // last raw motion
+#endif
+    } cursor;
+#if USE_XI
+    // XInput2, opcode -1 when not in use
+    struct {
+        int opcode;
+
+        // ID_SERIAL and event node to slave keyboard, dropped when the
+        // device goes away: a keyboard may have several nodes per serial
+        struct {
+            sym_t serial, devnode;
+            int deviceid;
+        } devices[XI_DEVICES];
+        size_t next;
+
+        // keyboards seen by udev before the server has added them
+        struct {
+            sym_t serial;
+            char devnode[64];
+        } pending[XI_PENDING];
+        size_t n_pending;
+    } xi;
+#endif
+
+    layout_t layout;
+
+    // exported for status bars, NULL when not published: see status.h
+    struct xhook_status* status;
+    char* status_path;
+
+    // the keymap process switching layouts in the background
+    struct {
+        pid_t pid;
+        layout_t running;
+        layout_t pending; // requested while running: the latest one wins
+        int stale; // layout reset while running
+        uint64_t t_spawn, t_focus;
+    } hook;
+
+    // keymaps preloaded for xkb_layouts, NULL where loading failed
+    struct {
+        XkbDescPtr* descs;
+        size_t n;
+    } xkb;
+
+    int tfd;
+
+    Display* dpy;
+#if USE_XCB
+    xcb_connection_t* xcb;
+    xcb_intern_atom_cookie_t* atom_cookies; // in flight during startup
+#endif
+    int scr;
+    Window parent; // the default screen's root
+
+    // the roots of every screen, and the one whose window manager last
+    // announced an active window
+    Window* roots;
+    int n_roots;
+    Window focus_root;
+
+#if USE_RANDR
+    int randr_event; // -1 without the extension
+#endif
+#if USE_XSS
+    int xss_event; // -1 without the extension
+#endif
+
+    Atom net_wm_name, wm_name, utf8_string, string, compound_text, wm_class;
+    Atom net_active_window, net_supported, net_supporting_wm_check;
+    Atom net_wm_pid, net_wm_window_type;
+    Atom device_node;
+
+    // window types ignored by the hooks, see skip_window_types
+    Atom skip_types[SKIP_TYPES_MAX];
+    size_t n_skip_types;
+    int skip_transient; // see skip_transient
+
+    struct stats* stats;
+    struct atom_names* atom_names;
+    struct slab* names;
+    struct window_cache* wc;
+    struct decision_cache* dc;
+    struct pid_cache* pc;
+    struct x11_errors* errors;
+};
+
+// work deferred until the descriptors ready have been serviced
+struct task {
+    void (*run)(struct state* st);
+    struct state* st;
+};
+
+#define RUN_QUEUE_SIZE 32
+
+// shared by all displays
+#define SUBSCRIBERS_MAX 16
+#define SUBSCRIBER_BUFFER 4096
+
+struct subscriber {
+    int fd;
+    int polled; // watched for EPOLLOUT: while len > 0
+    size_t len; // records the socket would not take yet
+    char buf[SUBSCRIBER_BUFFER];
+};
+
+struct xhook {
+    int running;
+
+    int epfd;
+    struct source* sources;
+    size_t n_sources;
+
+    struct {
+        struct task tasks[RUN_QUEUE_SIZE];
+        size_t head, n;
+    } runq;
+
+    int sfd;
+
+    struct udev* udev;
+    struct udev_monitor* udev_mon;
+
+    struct symtab* syms;
+    struct ruleset rules;
+
+    // the rule file replacing the compiled in rules, watched for changes
+    struct {
+        const char* path;
+        char* dir;
+        const char* base;
+        int fd;
+    } rules_file;
+
+    // clients streaming focus changes and layout switches, -1 when not
+    // listening
+    struct {
+        int fd;
+        char* path;
+        struct subscriber clients[SUBSCRIBERS_MAX];
+        size_t n;
+        // the loop's source for the clients with a backlog
+        struct source* writable;
+    } subs;
+
+    // -R: the inputs of the focus pipeline written as they happen
+    struct {
+        FILE* f;
+        uint64_t t0;
+    } rec;
+
+    // -P: a recording fed back through the pipeline, NULL unless replaying
+    struct replay* replay;
+
+    struct state* displays;
+    size_t n;
+};
+
+static void stats_init(struct state* st)
+{
+    st->stats = calloc(1, sizeof(*st->stats));
+    CHECK_MALLOC(st->stats);
+    st->stats->start = now_ns();
+}
+
+static void stats_deinit(struct state* st)
+{
+    free(st->stats);
+    st->stats = NULL;
+}
+
+// blocking requests waiting for a reply from the server
+static void stats_roundtrip(const struct state* st)
+{
+    st->stats->roundtrips += 1;
+}
+
+// the atoms interned at startup
+static const struct {
+    size_t offset;
+    const char* name;
+} x11_atoms[] = {
+    { offsetof(struct state, net_wm_name), "_NET_WM_NAME" },
+    { offsetof(struct state, wm_name), "WM_NAME" },
+    { offsetof(struct state, utf8_string), "UTF8_STRING" },
+    { offsetof(struct state, string), "STRING" },
+    { offsetof(struct state, compound_text), "COMPOUND_TEXT" },
+    { offsetof(struct state, wm_class), "WM_CLASS" },
+    { offsetof(struct state, net_active_window), "_NET_ACTIVE_WINDOW" },
+    { offsetof(struct state, net_supported), "_NET_SUPPORTED" },
+    { offsetof(struct state, net_supporting_wm_check),
+        "_NET_SUPPORTING_WM_CHECK" },
+    { offsetof(struct state, net_wm_pid), "_NET_WM_PID" },
+    { offsetof(struct state, net_wm_window_type), "_NET_WM_WINDOW_TYPE" },
+    { offsetof(struct state, device_node), "Device Node" },
+};
+
+static Atom* x11_atom(struct state* st, size_t i)
+{
+    return (Atom*)((char*)st + x11_atoms[i].offset);
+}
+
+// names of other atoms, looked up once and then kept until evicted
+#define ATOM_NAMES 16
+#define ATOM_NAME_MAX 64
+
+struct atom_names {
+    struct {
+        Atom atom;
+        char name[ATOM_NAME_MAX];
+    } entries[ATOM_NAMES];
+    size_t next;
+};
+
+// for logging: resolves the atoms known at startup without asking the server
+static const char* atom_name(const struct state* st, Atom a)
+{
+    if(a == None) {
+        return "None";
+    }
+
+    for(size_t i = 0; i < LENGTH(x11_atoms); i++) {
+        if(*(const Atom*)((const char*)st + x11_atoms[i].offset) == a) {
+            return x11_atoms[i].name;
+        }
+    }
+
+    if(a == XA_ATOM) return "ATOM";
+    if(a == XA_CARDINAL) return "CARDINAL";
+    if(a == XA_WINDOW) return "WINDOW";
+
+    struct atom_names* an = st->atom_names;
+    if(an == NULL) {
+        return "?"; // replaying: no server to ask
+    }
+    for(size_t i = 0; i < ATOM_NAMES; i++) {
+        if(an->entries[i].atom == a) {
+            return an->entries[i].name;
+        }
+    }
+
+    size_t i = an->next;
+    an->next = (i + 1) % ATOM_NAMES;
+
+    stats_roundtrip(st);
+    char* n = XGetAtomName(st->dpy, a);
+    an->entries[i].atom = n != NULL ? a : None;
+    snprintf(LIT(an->entries[i].name), "%s", n != NULL ? n : "?");
+    if(n != NULL) {
+        XFree(n);
+    }
+    return an->entries[i].name;
+}
+
+static struct x11_errors* x11_errors_of(const Display* d)
+{
+    const struct xhook* x = x11_errors_xhook;
+    for(size_t i = 0; x != NULL && i < x->n; i++) {
+        if(x->displays[i].dpy == d) {
+            return x->displays[i].errors;
+        }
+    }
+    return NULL;
+}
+
+// a BadWindow in the requests sent between x11_quiet_begin and
+// x11_quiet_end is no cause for concern. The range is open until then:
+// Xlib reports the errors of synchronous requests while they are made
+static size_t x11_quiet_begin(const struct state* st)
+{
+    struct x11_errors* errs = st->errors;
+    size_t i = errs->next;
+    errs->next = (i + 1) % X11_QUIET_RANGES;
+    errs->quiet[i].first = NextRequest(st->dpy);
+    errs->quiet[i].last = ULONG_MAX;
+    return i;
+}
+
+static void x11_quiet_end(const struct state* st, size_t i)
+{
+    // empty when nothing was sent
+    st->errors->quiet[i].last = NextRequest(st->dpy) - 1;
+}
+
+// Xlib calls this instead of exiting: the broken display's calls fail from
+// now on, and the main loop reconnects
+static void x11_io_error(Display* d, void* p)
+{
+    struct state* st = p;
+    if(!st->lost) {
+        error("lost the connection to %s", XDisplayString(d));
+        st->lost = 1;
+    }
+}
+
+static void x11_deinit(struct state* st);
+
+// -1 when the display could not be opened: the current connection, if
+// any, is then kept
+// the window types of config.h, interned along with x11_atoms
+static size_t window_filter_types(const char*** names);
+static void window_filter_init(struct state* st, const Atom* as, size_t n);
+
+static int x11_init(struct state* st)
+{
+    XSetErrorHandler(handle_x11_error);
+
+    Display* dpy = XOpenDisplay(st->name);
+    if(dpy == NULL) {
+        return -1;
+    }
+    if(st->dpy != NULL) {
+        x11_deinit(st);
+    }
+    st->dpy = dpy;
+    XSetIOErrorExitHandler(st->dpy, x11_io_error, st);
+
+#if USE_XCB
+    st->xcb = XGetXCBConnection(st->dpy);
+#endif
+
+    st->scr = DefaultScreen(st->dpy);
+    st->parent = RootWindow(st->dpy, st->scr);
+
+    st->n_roots = ScreenCount(st->dpy);
+    st->roots = calloc(st->n_roots, sizeof(*st->roots));
+    CHECK_MALLOC(st->roots);
+    for(int i = 0; i < st->n_roots; i++) {
+        Window r = st->roots[i] = RootWindow(st->dpy, i);
+        info("tracking focus changes of %lu and its children on %s (%s)",
+             r, XDisplayString(st->dpy), st->seat);
+        XSelectInput(st->dpy, r, FocusChangeMask | PropertyChangeMask);
+    }
+    st->focus_root = st->parent;
+
+#if USE_RANDR
+    int err;
+    stats_roundtrip(st);
+    if(XRRQueryExtension(st->dpy, &st->randr_event, &err)) {
+        for(int i = 0; i < st->n_roots; i++) {
+            XRRSelectInput(st->dpy, st->roots[i],
+                           RRScreenChangeNotifyMask
+                           | RROutputChangeNotifyMask);
+        }
+    } else {
+        warning("RandR extension not available");
+        st->randr_event = -1;
+    }
+#endif
+
+#if USE_XSS
+    int xss_err;
+    stats_roundtrip(st);
+    if(XScreenSaverQueryExtension(st->dpy, &st->xss_event, &xss_err)) {
+        for(int i = 0; i < st->n_roots; i++) {
+            XScreenSaverSelectInput(st->dpy, st->roots[i],
+                                    ScreenSaverNotifyMask);
+        }
+    } else {
+        warning("MIT-SCREEN-SAVER extension not available");
+        st->xss_event = -1;
+    }
+#endif
+
+    st->atom_names = calloc(1, sizeof(*st->atom_names));
+    CHECK_MALLOC(st->atom_names);
+
+#if USE_XCB
+    // sent now, the replies are collected by x11_init_atoms
+    const char** types;
+    size_t n_types = window_filter_types(&types);
+    st->atom_cookies = calloc(LENGTH(x11_atoms) + n_types,
+                              sizeof(*st->atom_cookies));
+    CHECK_MALLOC(st->atom_cookies);
+    for(size_t i = 0; i < LENGTH(x11_atoms) + n_types; i++) {
+        const char* n = i < LENGTH(x11_atoms) ? x11_atoms[i].name
+            : types[i - LENGTH(x11_atoms)];
+        st->atom_cookies[i] = xcb_intern_atom(st->xcb, 0, strlen(n), n);
+    }
+    xcb_flush(st->xcb);
+#endif
+
+    return 0;
+}
+
+// wait for the atoms: one round trip which also flushes out any error
+// caused by the requests sent by x11_init
+static void x11_init_atoms(struct state* st)
+{
+    const char** types;
+    size_t n_types = window_filter_types(&types);
+    const size_t n = LENGTH(x11_atoms) + n_types;
+    Atom atoms[n];
+
+    stats_roundtrip(st);
+#if USE_XCB
+    for(size_t i = 0; i < n; i++) {
+        xcb_generic_error_t* err = NULL;
+        xcb_intern_atom_reply_t* r =
+            xcb_intern_atom_reply(st->xcb, st->atom_cookies[i], &err);
+        if(r == NULL) {
+            failwith("xcb_intern_atom(%s): error_code=%u",
+                     i < LENGTH(x11_atoms) ? x11_atoms[i].name
+                     : types[i - LENGTH(x11_atoms)],
+                     err != NULL ? err->error_code : 0);
+        }
+        atoms[i] = r->atom;
+        free(r);
+    }
+    free(st->atom_cookies);
+    st->atom_cookies = NULL;
+#else
+    char* names[n];
+    for(size_t i = 0; i < n; i++) {
+        names[i] = (char*)(i < LENGTH(x11_atoms) ? x11_atoms[i].name
+                           : types[i - LENGTH(x11_atoms)]);
+    }
+
+    if(!XInternAtoms(st->dpy, names, n, False, atoms)) {
+        failwith("XInternAtoms");
+    }
+#endif
+
+    for(size_t i = 0; i < LENGTH(x11_atoms); i++) {
+        *x11_atom(st, i) = atoms[i];
+    }
+    window_filter_init(st, atoms + LENGTH(x11_atoms), n_types);
+}
+
+static void x11_deinit(struct state* st)
+{
+    free(st->atom_names);
+    st->atom_names = NULL;
+
+    free(st->roots);
+    st->roots = NULL;
+
+    if(!st->lost) {
+        XSync(st->dpy, True);
+    }
+    XCloseDisplay(st->dpy);
+    st->dpy = NULL;
+}
+
+static int x11_is_root(const struct state* st, Window w)
+{
+    for(int i = 0; i < st->n_roots; i++) {
+        if(st->roots[i] == w) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int x11_fd(const struct state* st)
+{
+    return XConnectionNumber(st->dpy);
+}
+
+#define MAX_STR 1024
+#define MAX_CLASS 10
+#define MAX_DEPTH 16
+
+struct window
+{
+    Window window;
+    Window parent, root;
+
+    const char* name; // slab allocated, see window_set_name
+    uint16_t name_len;
+    uint8_t partial; // only class, parent and root are resolved
+    uint8_t n_class;
+    sym_t class[MAX_CLASS];
+
+    // only resolved along with the name
+    uint8_t transient; // WM_TRANSIENT_FOR is set
+    Atom type; // the preferred _NET_WM_WINDOW_TYPE, None if not set
+    sym_t exe; // basename of _NET_WM_PID's executable, SYM_NONE if unknown
+
+    // memoized by window_ancestors, valid while ancestry matches the
+    // cache's generation
+    uint8_t n_ancestors;
+    unsigned long ancestry;
+    Window ancestors[MAX_DEPTH];
+};
+
+static void window_release(const struct state* st, struct window* w)
+{
+    if(w->name_len > 0) {
+        slab_free(st->names, (void*)w->name, w->name_len + 1);
+    }
+    w->name = "";
+    w->name_len = 0;
+}
+
+// the name is copied straight out of the reply: the slab's copy is the
+// only one
+static void window_set_name(const struct state* st, struct window* w,
+                            const char* name, size_t n)
+{
+    window_release(st, w);
+
+    n = strnlen(name, MIN(n, MAX_STR));
+    if(n > 0) {
+        char* c = slab_alloc(st->names, n + 1);
+        memcpy(c, name, n);
+        c[n] = '\0';
+        w->name = c;
+        w->name_len = n;
+    }
+}
+
+// the parsers read the replies in place and look at no more than the
+// MAX_STR bytes of a name and MAX_CLASS strings of a class: anything
+// beyond (after, the bytes left unread by the server) is reported and
+// dropped
+
+static int x11_parse_name(const struct state* st, struct window* win,
+                          Atom p, Atom t, int fmt,
+                          const unsigned char* b, size_t n, size_t after)
+{
+    const Window w = win->window;
+    if(t == None) {
+        debug("window %lu has no name", w);
+        return 0;
+    }
+
+    if(t == st->compound_text) {
+        warning("window %lu has COMPOUND_TEXT name: ignoring", w);
+        return 0;
+    }
+
+    // not cached: looked up again next time
+    if(t != st->utf8_string && t != st->string) {
+        warning("XGetWindowProperty(%lu, %s) returned an unexpected type: %s",
+                w, atom_name(st, p), atom_name(st, t));
+        return -1;
+    }
+
+    if(fmt != 8) {
+        warning("XGetWindowProperty(%lu, %s) returned an unexpected format: "
+                "%d", w, atom_name(st, p), fmt);
+        return -1;
+    }
+
+    if(n > MAX_STR-1 || after > 0) {
+        warning("window %lu: %s truncated to %d bytes",
+                w, atom_name(st, p), MAX_STR-1);
+        n = MIN(n, MAX_STR-1);
+    }
+
+    window_set_name(st, win, (const char*)b, n);
+    return 0;
+}
+
+static int x11_parse_class(const struct state* st, Window w,
+                           Atom t, int fmt,
+                           const unsigned char* b, size_t n, size_t after,
+                           sym_t cls[MAX_CLASS],
+                           uint8_t* n_cls)
+{
+    if(t == None) {
+        trace("window %lu has no class", w);
+        *n_cls = 0;
+        return 0;
+    }
+
+    if(t != XA_STRING) {
+        warning("XGetWindowProperty(%lu, %s) returned an unexpected type: %s",
+                w, atom_name(st, st->wm_class), atom_name(st, t));
+        return -1;
+    }
+
+    if(fmt != 8) {
+        warning("XGetWindowProperty(%lu, %s) returned an unexpected format: "
+                "%d", w, atom_name(st, st->wm_class), fmt);
+        return -1;
+    }
+
+    const char* p = (const char*)b;
+    const char* P = p + n;
+    size_t i = 0;
+    int truncated = after > 0;
+    for(; p < P && i < MAX_CLASS; i++) {
+        size_t l = strnlen(p, P - p);
+        if(l > MAX_STR-1) {
+            truncated = 1;
+        }
+        cls[i] = sym_intern(st->x->syms, p, MIN(MAX_STR-1, l));
+        p += l + 1;
+    }
+
+    if(truncated || p < P) {
+        warning("window %lu: %s truncated to %zu strings of %d bytes",
+                w, atom_name(st, st->wm_class), i, MAX_STR-1);
+    }
+
+    *n_cls = i;
+    return 0;
+}
+
+// _NET_WM_PID to executable: shared by the windows of one process, and
+// saves a readlink on /proc for every new window. Pids are reused but
+// rarely before an entry is replaced, and those of windows from other
+// hosts resolve to an unrelated process or more likely to none
+//
+// Wine and Proton run every program as wine*-preloader: for those the
+// kernel's name for the process is used instead, the executable's name
+// truncated to 15 characters
+#define PID_CACHE_SIZE 32
+
+struct pid_cache {
+    struct {
+        pid_t pid; // 0: unused
+        sym_t exe;
+    } entries[PID_CACHE_SIZE];
+    size_t next;
+    size_t hits, misses;
+};
+
+static void pid_cache_init(struct state* st)
+{
+    st->pc = calloc(1, sizeof(*st->pc));
+    CHECK_MALLOC(st->pc);
+}
+
+static void pid_cache_deinit(struct state* st)
+{
+    free(st->pc);
+    st->pc = NULL;
+}
+
+static sym_t pid_exe(const struct state* st, pid_t pid)
+{
+    struct pid_cache* pc = st->pc;
+    for(size_t i = 0; i < PID_CACHE_SIZE; i++) {
+        if(pc->entries[i].pid == pid) {
+            pc->hits += 1;
+            return pc->entries[i].exe;
+        }
+    }
+    pc->misses += 1;
+
+    char path[32], buf[MAX_STR];
+    snprintf(LIT(path), "/proc/%d/exe", (int)pid);
+    ssize_t n = readlink(path, buf, sizeof(buf) - 1);
+
+    sym_t exe = SYM_NONE;
+    if(n > 0) {
+        buf[n] = '\0';
+        const char* b = strrchr(buf, '/');
+        b = b != NULL ? b + 1 : buf;
+
+        // Windows programs all run the loader: their name is in comm
+        if(fnmatch("wine*-preloader", b, 0) == 0) {
+            char comm[32];
+            snprintf(LIT(path), "/proc/%d/comm", (int)pid);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            ssize_t m = fd >= 0 ? read(fd, comm, sizeof(comm) - 1) : -1;
+            if(fd >= 0) {
+                int r = close(fd); CHECK(r, "close");
+            }
+            if(m > 0) {
+                comm[m] = '\0';
+                comm[strcspn(comm, "\n")] = '\0';
+                b = comm;
+            }
+        }
+
+        exe = sym_intern(st->x->syms, STR(b));
+    } else {
+        debug("readlink(%s): %s", path, strerror(errno));
+    }
+
+    size_t i = pc->next;
+    pc->next = (i + 1) % PID_CACHE_SIZE;
+    pc->entries[i].pid = pid;
+    pc->entries[i].exe = exe;
+    return exe;
+}
+
+#if USE_XCB
+// the first item of a 32-bit property, 0 when not set or of another type
+static unsigned long x11_reply_long(const xcb_get_property_reply_t* r,
+                                    Atom type)
+{
+    if(r->type != type || r->format != 32
+       || xcb_get_property_value_length(r) < 4) {
+        return 0;
+    }
+    return *(const uint32_t*)xcb_get_property_value(r);
+}
+
+// all requests are sent up front and the replies collected afterwards:
+// one round trip no matter how many properties are needed
+static int x11_window_fetch(const struct state* st, Window wx,
+                            struct window* w, int name, pid_t* pid)
+{
+    xcb_connection_t* c = st->xcb;
+
+    xcb_get_property_cookie_t net_wm_name, wm_name;
+    xcb_get_property_cookie_t net_wm_pid, net_wm_window_type, transient;
+    if(name) {
+        net_wm_name = xcb_get_property(
+            c, 0 /* delete */, wx, st->net_wm_name, st->utf8_string,
+            0, MAX_STR/4);
+        wm_name = xcb_get_property(
+            c, 0 /* delete */, wx, st->wm_name, st->string,
+            0, MAX_STR/4);
+        net_wm_pid = xcb_get_property(
+            c, 0 /* delete */, wx, st->net_wm_pid, XA_CARDINAL, 0, 1);
+        net_wm_window_type = xcb_get_property(
+            c, 0 /* delete */, wx, st->net_wm_window_type, XA_ATOM, 0, 1);
+        transient = xcb_get_property(
+            c, 0 /* delete */, wx, XA_WM_TRANSIENT_FOR, XA_WINDOW, 0, 1);
+    }
+    xcb_get_property_cookie_t wm_class = xcb_get_property(
+        c, 0 /* delete */, wx, st->wm_class, XA_STRING,
+        0, MAX_CLASS*MAX_STR/4);
+    xcb_query_tree_cookie_t tree = xcb_query_tree(c, wx);
+    debug("xcb: requested properties and tree of %lu", wx);
+
+    stats_roundtrip(st);
+    xcb_generic_error_t* err[7] = { NULL };
+    xcb_get_property_reply_t* rnn = NULL, * rn = NULL;
+    xcb_get_property_reply_t* rp = NULL, * rwt = NULL, * rtf = NULL;
+    if(name) {
+        rnn = xcb_get_property_reply(c, net_wm_name, &err[0]);
+        rn = xcb_get_property_reply(c, wm_name, &err[1]);
+        rp = xcb_get_property_reply(c, net_wm_pid, &err[4]);
+        rwt = xcb_get_property_reply(c, net_wm_window_type, &err[5]);
+        rtf = xcb_get_property_reply(c, transient, &err[6]);
+    }
+    xcb_get_property_reply_t* rc = xcb_get_property_reply(c, wm_class, &err[2]);
+    xcb_query_tree_reply_t* rt = xcb_query_tree_reply(c, tree, &err[3]);
+
+    int ret = -1;
+    for(size_t i = 0; i < LENGTH(err); i++) {
+        if(err[i] != NULL) {
+            debug("xcb: request %zu for %lu failed: error_code=%u",
+                  i, wx, err[i]->error_code);
+            goto out;
+        }
+    }
+
+    // neither reply nor error: the connection is gone
+    if(rc == NULL || rt == NULL
+       || (name && (rnn == NULL || rn == NULL
+                    || rp == NULL || rwt == NULL || rtf == NULL))) {
+        debug("xcb: no replies for %lu", wx);
+        goto out;
+    }
+
+    if(name) {
+        Atom p = st->net_wm_name;
+        xcb_get_property_reply_t* r = rnn;
+        if(r->type == None) {
+            p = st->wm_name;
+            r = rn;
+        }
+        if(x11_parse_name(st, w, p, r->type, r->format,
+                          xcb_get_property_value(r),
+                          xcb_get_property_value_length(r),
+                          r->bytes_after) != 0) {
+            goto out;
+        }
+
+        *pid = x11_reply_long(rp, XA_CARDINAL);
+        w->type = x11_reply_long(rwt, XA_ATOM);
+        w->transient = x11_reply_long(rtf, XA_WINDOW) != None;
+    }
+
+    if(x11_parse_class(st, wx, rc->type, rc->format,
+                       xcb_get_property_value(rc),
+                       xcb_get_property_value_length(rc),
+                       rc->bytes_after,
+                       w->class, &w->n_class) != 0) {
+        goto out;
+    }
+
+    w->root = rt->root;
+    w->parent = rt->parent;
+
+    ret = 0;
+out:
+    for(size_t i = 0; i < LENGTH(err); i++) {
+        free(err[i]);
+    }
+    free(rnn);
+    free(rn);
+    free(rp);
+    free(rwt);
+    free(rtf);
+    free(rc);
+    free(rt);
+    return ret;
+}
+#else
+// the first item of a 32-bit property, 0 when not set or of another type
+static int x11_window_prop_long(const struct state* st, Window w,
+                                Atom p, Atom type, unsigned long* v)
+{
+    Atom t = None;
+    int fmt;
+    unsigned long nitems, remaining;
+    unsigned char* b = NULL;
+    stats_roundtrip(st);
+    int res = XGetWindowProperty(st->dpy, w, p,
+                                 0L, 1L,
+                                 False /* delete */,
+                                 type /* req_type */,
+                                 &t /* actual_type */,
+                                 &fmt, &nitems, &remaining, &b);
+
+    if(res != Success) {
+        debug("XGetWindowProperty(%lu, %s) failed",
+              w, atom_name(st, p));
+        return -1;
+    }
+
+    if(t == type && fmt == 32 && nitems == 1) {
+        *v = *(unsigned long*)b;
+    } else {
+        *v = 0;
+    }
+
+    if(b != NULL) {
+        XFree(b);
+    }
+    return 0;
+}
+
+static int x11_window_name(const struct state* st, struct window* win)
+{
+    const Window w = win->window;
+    Atom t = None;
+    int fmt;
+    unsigned long nitems, remaining;
+    unsigned char* b = NULL;
+
+    Atom p = st->net_wm_name, T = st->utf8_string;
+
+attempt:
+    debug("XGetWindowProperty(%lu, %s)", w, atom_name(st, p));
+    stats_roundtrip(st);
+    int res = XGetWindowProperty(st->dpy, w, p,
+                                 0L, MAX_STR/4,
+                                 False /* delete */,
+                                 T /* req_type */,
+                                 &t /* actual_type */,
+                                 &fmt, &nitems, &remaining, &b);
+
+    if(res != Success) {
+        debug("XGetWindowProperty(%lu, %s) failed",
+              w, atom_name(st, p));
+        return -1;
+    }
+
+    if(t == None && p == st->net_wm_name) {
+        p = st->wm_name;
+        T = st->string;
+        goto attempt;
+    }
+
+    res = x11_parse_name(st, win, p, t, fmt, b, nitems, remaining);
+    if(b != NULL) {
+        XFree(b);
+    }
+    return res;
+}
+
+static int x11_window_class(const struct state* st, Window w,
+                            sym_t cls[MAX_CLASS],
+                            uint8_t* n_cls)
+{
+    Atom t = None;
+    int fmt;
+    unsigned long nitems, remaining;
+    unsigned char* b = NULL;
+    stats_roundtrip(st);
+    int res = XGetWindowProperty(st->dpy, w, st->wm_class,
+                                 0L, MAX_CLASS*MAX_STR/4,
+                                 False /* delete */,
+                                 XA_STRING /* req_type */,
+                                 &t /* actual_type */,
+                                 &fmt, &nitems, &remaining, &b);
+
+    if(res != Success) {
+        debug("XGetWindowProperty(%lu, %s) failed",
+              w, atom_name(st, st->wm_class));
+        return -1;
+    }
+
+    res = x11_parse_class(st, w, t, fmt, b, nitems, remaining, cls, n_cls);
+    if(b != NULL) {
+        XFree(b);
+    }
+    return res;
+}
+
+static int x11_window_parent(const struct state* st, Window w,
+                             Window* root, Window* parent)
+{
+    Window r, p;
+    Window *children = NULL;
+    unsigned int children_n;
+    stats_roundtrip(st);
+    Status res = XQueryTree(st->dpy, w,
+                            root != NULL ? root : &r,
+                            parent != NULL ? parent : &p,
+                            &children, &children_n);
+
+    if(!res) {
+        debug("XQueryTree(%lu) failed", w);
+        return -1;
+    }
+
+    XFree(children);
+
+    return 0;
+}
+
+static int x11_window_fetch(const struct state* st, Window wx,
+                            struct window* w, int name, pid_t* pid)
+{
+    if(name && x11_window_name(st, w) != 0) {
+        return -1;
+    }
+
+    // a round trip each: only what the rules and filters look at
+    unsigned long p = 0, t = None, tf = None;
+    if(name && ((st->x->rules.exe
+                 && x11_window_prop_long(st, wx, st->net_wm_pid,
+                                         XA_CARDINAL, &p) != 0)
+                || (st->n_skip_types > 0
+                    && x11_window_prop_long(st, wx, st->net_wm_window_type,
+                                            XA_ATOM, &t) != 0)
+                || (st->skip_transient
+                    && x11_window_prop_long(st, wx, XA_WM_TRANSIENT_FOR,
+                                            XA_WINDOW, &tf) != 0))) {
+        return -1;
+    }
+    if(name) {
+        *pid = p;
+        w->type = t;
+        w->transient = tf != None;
+    }
+
+    if(x11_window_class(st, wx, w->class, &w->n_class) != 0) {
+        return -1;
+    }
+
+    if(x11_window_parent(st, wx, &w->root, &w->parent) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+// recordings: a header and then one record per input, each with the
+// nanoseconds since the recording started:
+//   REC_FOCUS, REC_TICK        a focus event, a settle or poll timer tick
+//   REC_START, REC_CHECK       the focus resolved at startup, re-checked
+//                              after a window manager change or reconnect
+//   REC_UDEV                   keyboards added (uint32_t)
+//   REC_INVALIDATE, REC_DESTROY    a cached window changed, was destroyed
+//   REC_REPARENT               window and new parent (2 uint64_t)
+//   REC_CURRENT                the focused window as queried (uint64_t)
+//   REC_WINDOW                 a resolved window: struct rec_window
+// REC_CURRENT and REC_WINDOW are the server's replies, the rest drive the
+// pipeline
+#define REC_MAGIC 0x78686b74 // "xhkt"
+#define REC_VERSION 1
+
+enum rec_type {
+    REC_HEADER = 1,
+    REC_FOCUS,
+    REC_TICK,
+    REC_UDEV,
+    REC_INVALIDATE,
+    REC_DESTROY,
+    REC_REPARENT,
+    REC_CURRENT,
+    REC_WINDOW,
+    REC_START,
+    REC_CHECK,
+};
+
+struct rec_header {
+    uint8_t type;
+    uint8_t display; // index of the display in the recording
+    uint16_t len; // of the payload that follows
+    uint32_t reserved;
+    uint64_t t;
+};
+
+struct rec_file {
+    uint32_t magic, version, n_displays;
+};
+
+// followed by n_class NUL terminated classes and, unless partial, the name
+// (name_len bytes), the window type and the executable, NUL terminated
+struct rec_window {
+    uint64_t window, root, parent;
+    uint8_t ok, partial, transient, n_class;
+    uint16_t name_len;
+    uint16_t reserved;
+};
+
+#define REC_WINDOW_MAX (sizeof(struct rec_window) \
+    + MAX_CLASS * MAX_STR + 3 * MAX_STR)
+
+static void rec_write(const struct state* st, enum rec_type type,
+                      const void* p, size_t n)
+{
+    FILE* f = st->x->rec.f;
+    if(f == NULL) {
+        return;
+    }
+
+    struct rec_header h = {
+        .type = type,
+        .display = st - st->x->displays,
+        .len = n,
+        .t = now_ns() - st->x->rec.t0,
+    };
+    if(fwrite(&h, sizeof(h), 1, f) != 1
+       || (n > 0 && fwrite(p, n, 1, f) != 1)) {
+        failwith("unable to write the recording");
+    }
+}
+
+static void rec_event(const struct state* st, enum rec_type type)
+{
+    rec_write(st, type, NULL, 0);
+}
+
+static void rec_window_id(const struct state* st, enum rec_type type,
+                          Window w)
+{
+    uint64_t v = w;
+    rec_write(st, type, &v, sizeof(v));
+}
+
+static size_t rec_str(char* b, size_t i, const char* s, size_t n)
+{
+    memcpy(b + i, s, n);
+    b[i + n] = '\0';
+    return i + n + 1;
+}
+
+static void rec_window(const struct state* st, const struct window* w,
+                       int ok)
+{
+    if(st->x->rec.f == NULL) {
+        return;
+    }
+
+    static char b[REC_WINDOW_MAX];
+    struct rec_window* r = (struct rec_window*)b;
+    *r = (struct rec_window) {
+        .window = w->window, .root = w->root, .parent = w->parent,
+        .ok = ok, .partial = w->partial, .transient = w->transient,
+        .n_class = ok ? w->n_class : 0, .name_len = w->name_len,
+    };
+
+    size_t i = sizeof(*r);
+    for(size_t k = 0; k < r->n_class; k++) {
+        const char* c = sym_str(st->x->syms, w->class[k]);
+        i = rec_str(b, i, c, strlen(c));
+    }
+    if(!w->partial) {
+        memcpy(b + i, w->name, w->name_len);
+        i += w->name_len;
+        const char* t = w->type != None ? atom_name(st, w->type) : "";
+        i = rec_str(b, i, t, strlen(t));
+        const char* e = sym_str(st->x->syms, w->exe);
+        i = rec_str(b, i, e, strlen(e));
+    }
+
+    rec_write(st, REC_WINDOW, b, i);
+}
+
+static void rec_open(struct xhook* x, const char* path)
+{
+    x->rec.f = fopen(path, "we");
+    if(x->rec.f == NULL) {
+        failwith("unable to open %s: %s", path, strerror(errno));
+    }
+    x->rec.t0 = now_ns();
+
+    struct rec_file h = {
+        .magic = REC_MAGIC, .version = REC_VERSION, .n_displays = x->n,
+    };
+    rec_write(&x->displays[0], REC_HEADER, &h, sizeof(h));
+    info("recording to %s", path);
+}
+
+static void rec_close(struct xhook* x)
+{
+    if(x->rec.f != NULL) {
+        if(fclose(x->rec.f) != 0) {
+            failwith("unable to write the recording: %s", strerror(errno));
+        }
+        x->rec.f = NULL;
+    }
+}
+
+// the replies of the recording, as of the event being replayed: window
+// types are interned as symbols, standing in for the atoms
+#define REPLAY_BUCKETS 1024
+
+struct replay_window {
+    Window window, root, parent;
+    uint8_t ok, named, transient, n_class;
+    sym_t class[MAX_CLASS];
+    sym_t type, exe;
+    char* name;
+    struct replay_window* next;
+};
+
+struct replay_display {
+    Window current;
+    struct replay_window* buckets[REPLAY_BUCKETS];
+};
+
+struct replay {
+    FILE* f;
+    const char* path;
+    size_t n;
+    struct replay_display* displays;
+    size_t events, replies;
+
+    // the record read last
+    struct rec_header h;
+    char buf[REC_WINDOW_MAX];
+};
+
+static int replaying(const struct state* st)
+{
+    return st->x->replay != NULL;
+}
+
+static struct replay_window** replay_bucket(struct replay_display* d,
+                                            Window w)
+{
+    return &d->buckets[w % REPLAY_BUCKETS];
+}
+
+static struct replay_window* replay_find(struct replay_display* d, Window w)
+{
+    struct replay_window* e = *replay_bucket(d, w);
+    while(e != NULL && e->window != w) {
+        e = e->next;
+    }
+    return e;
+}
+
+static struct replay_display* replay_display(const struct state* st)
+{
+    return &st->x->replay->displays[st - st->x->displays];
+}
+
+static Window replay_current(const struct state* st)
+{
+    return replay_display(st)->current;
+}
+
+// x11_window from the recorded replies: unknown windows fail as vanished
+// ones would
+static int replay_window(const struct state* st, Window wx,
+                         struct window* w, int name)
+{
+    const struct replay_window* e = replay_find(replay_display(st), wx);
+    if(e == NULL || !e->ok) {
+        return -1;
+    }
+
+    w->root = e->root;
+    w->parent = e->parent;
+    w->n_class = e->n_class;
+    memcpy(w->class, e->class, e->n_class * sizeof(sym_t));
+    if(name && e->named) {
+        window_set_name(st, w, e->name, strlen(e->name));
+        w->transient = e->transient;
+        w->type = e->type;
+        w->exe = e->exe;
+    }
+    return 0;
+}
+
+// name == 0 skips fetching the name, as needed for ancestors
+static int x11_window(const struct state* st, Window wx, struct window* w,
+                      int name)
+{
+    window_release(st, w);
+    w->window = wx;
+    w->partial = !name;
+    w->n_class = 0;
+    w->n_ancestors = 0;
+    w->ancestry = 0;
+    w->transient = 0;
+    w->type = None;
+    w->exe = SYM_NONE;
+
+    if(replaying(st)) {
+        return replay_window(st, wx, w, name);
+    }
+
+    pid_t pid = 0;
+    if(x11_window_fetch(st, wx, w, name, &pid) != 0) {
+        window_release(st, w); // the name may have been set already
+        rec_window(st, w, 0);
+        return -1;
+    }
+
+    if(w->name_len > 0) {
+        debug("window %lu name: %s", wx, w->name);
+    }
+    if(pid > 0 && st->x->rules.exe) {
+        w->exe = pid_exe(st, pid);
+        debug("window %lu pid: %d (%s)",
+              wx, (int)pid, sym_str(st->x->syms, w->exe));
+    }
+    if(w->transient) {
+        debug("window %lu is transient", wx);
+    }
+    for(size_t i = 0; i < w->n_class; i++) {
+        debug("window %lu class: %s",
+              wx, sym_str(st->x->syms, w->class[i]));
+    }
+    debug("window %lu root: %lu", wx, w->root);
+    debug("window %lu parent: %lu", wx, w->parent);
+
+    rec_window(st, w, 1);
+    return 0;
+}
+
+#define WINDOW_CACHE_SIZE 1024
+#define WINDOW_CACHE_BUCKETS 1024
+
+struct window_cache_entry {
+    struct window w;
+    int used;
+    unsigned long stamp;
+    struct window_cache_entry* next;
+};
+
+struct window_cache {
+    struct window_cache_entry entries[WINDOW_CACHE_SIZE];
+    struct window_cache_entry* buckets[WINDOW_CACHE_BUCKETS];
+
+    // uncached lookups (the root window) end up here
+    struct window scratch;
+    Window scratch_ancestors[MAX_DEPTH];
+
+    // entries touched since epoch are in use by the current event
+    unsigned long clock, epoch;
+
+    // bumped by ReparentNotify: invalidates all memoized ancestor chains
+    unsigned long ancestry;
+
+    size_t hits, misses, evictions, invalidations;
+};
+
+static void window_cache_init(struct state* st)
+{
+    st->wc = calloc(1, sizeof(*st->wc));
+    CHECK_MALLOC(st->wc);
+    st->wc->ancestry = 1;
+
+    st->names = calloc(1, sizeof(*st->names));
+    CHECK_MALLOC(st->names);
+
+    debug("window cache: %zu entries of %zu bytes",
+          (size_t)WINDOW_CACHE_SIZE, sizeof(struct window_cache_entry));
+}
+
+static void window_cache_deinit(struct state* st)
+{
+    free(st->wc);
+    st->wc = NULL;
+
+    arena_free(&st->names->arena);
+    free(st->names);
+    st->names = NULL;
+}
+
+static void symbols_init(struct xhook* x)
+{
+    x->syms = malloc(sizeof(*x->syms));
+    CHECK_MALLOC(x->syms);
+    symtab_init(x->syms);
+}
+
+static void symbols_deinit(struct xhook* x)
+{
+    symtab_free(x->syms);
+    free(x->syms);
+    x->syms = NULL;
+}
+
+static struct window_cache_entry** window_cache_bucket(
+    struct window_cache* wc, Window w)
+{
+    return &wc->buckets[(w ^ (w >> 16)) % WINDOW_CACHE_BUCKETS];
+}
+
+static struct window_cache_entry* window_cache_find(
+    struct window_cache* wc, Window w)
+{
+    struct window_cache_entry* e = *window_cache_bucket(wc, w);
+    while(e != NULL && e->w.window != w) {
+        e = e->next;
+    }
+    return e;
+}
+
+static void window_cache_unlink(const struct state* st,
+                                struct window_cache_entry* e)
+{
+    struct window_cache* wc = st->wc;
+    window_release(st, &e->w);
+
+    struct window_cache_entry** p = window_cache_bucket(wc, e->w.window);
+    while(*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+
+    e->next = NULL;
+    e->used = 0;
+}
+
+static struct window_cache_entry* window_cache_slot(const struct state* st)
+{
+    struct window_cache* wc = st->wc;
+    struct window_cache_entry* lru = NULL;
+    for(size_t i = 0; i < WINDOW_CACHE_SIZE; i++) {
+        struct window_cache_entry* e = &wc->entries[i];
+        if(!e->used) {
+            return e;
+        }
+
+        if(e->stamp < wc->epoch && (lru == NULL || e->stamp < lru->stamp)) {
+            lru = e;
+        }
+    }
+
+    if(lru != NULL) {
+        debug("window cache: evicting %lu", lru->w.window);
+        if(!replaying(st)) {
+            XSelectInput(st->dpy, lru->w.window, NoEventMask);
+        }
+        window_cache_unlink(st, lru);
+        wc->evictions += 1;
+    }
+
+    return lru;
+}
+
+// start of a new event: entries handed out from here on are not evicted
+// until the next call
+static void window_cache_epoch(const struct state* st)
+{
+    st->wc->epoch = ++st->wc->clock;
+
+    if(st->opts.no_cache) {
+        for(size_t i = 0; i < WINDOW_CACHE_SIZE; i++) {
+            struct window_cache_entry* e = &st->wc->entries[i];
+            if(e->used) {
+                window_cache_unlink(st, e);
+            }
+        }
+    }
+}
+
+static const struct window* window_cache_fill(const struct state* st,
+                                              struct window_cache_entry* e,
+                                              Window wx, int name)
+{
+    struct window_cache* wc = st->wc;
+    if(e != NULL) {
+        // upgrade a class-only entry: already linked and selected
+        e->stamp = ++wc->clock;
+        if(x11_window(st, wx, &e->w, name) != 0) {
+            window_cache_unlink(st, e);
+            return NULL;
+        }
+        return &e->w;
+    }
+
+    // roots are not cached: selecting on them would replace the root mask
+    if(x11_is_root(st, wx)) {
+        if(x11_window(st, wx, &wc->scratch, name) != 0) {
+            return NULL;
+        }
+        return &wc->scratch;
+    }
+
+    e = window_cache_slot(st);
+    if(e == NULL) {
+        warning("window cache exhausted: not caching %lu", wx);
+        if(x11_window(st, wx, &wc->scratch, name) != 0) {
+            return NULL;
+        }
+        return &wc->scratch;
+    }
+
+    // select before fetching so that changes racing the fetch are noticed
+    if(!replaying(st)) {
+        XSelectInput(st->dpy, wx, PropertyChangeMask | StructureNotifyMask);
+    }
+
+    if(x11_window(st, wx, &e->w, name) != 0) {
+        return NULL;
+    }
+
+    e->used = 1;
+    e->stamp = ++wc->clock;
+    struct window_cache_entry** b = window_cache_bucket(wc, wx);
+    e->next = *b;
+    *b = e;
+
+    return &e->w;
+}
+
+static const struct window* window_lookup(const struct state* st, Window wx,
+                                          int name)
+{
+    struct window_cache* wc = st->wc;
+
+    struct window_cache_entry* e = window_cache_find(wc, wx);
+    if(e != NULL && (!name || !e->w.partial)) {
+        e->stamp = ++wc->clock;
+        wc->hits += 1;
+        trace("window cache hit: %lu", wx);
+        return &e->w;
+    }
+
+    wc->misses += 1;
+    debug("window cache miss: %lu (hits=%zu misses=%zu)",
+          wx, wc->hits, wc->misses);
+
+    if(replaying(st)) {
+        return window_cache_fill(st, e, wx, name);
+    }
+
+    size_t q = x11_quiet_begin(st);
+    const struct window* w = window_cache_fill(st, e, wx, name);
+    x11_quiet_end(st, q);
+    return w;
+}
+static const struct window* window_get(const struct state* st, Window wx)
+{
+    return window_lookup(st, wx, 1);
+}
+
+static const struct window* window_get_class(const struct state* st,
+                                             Window wx)
+{
+    return window_lookup(st, wx, 0);
+}
+
+// the chain of ancestors below the root, resolved once (classes only) and
+// shared by every _rec predicate until something is reparented
+static const Window* window_ancestors(const struct state* st,
+                                      const struct window* w, size_t* n)
+{
+    struct window_cache* wc = st->wc;
+
+    struct window_cache_entry* e = window_cache_find(wc, w->window);
+    if(e != NULL && e->w.ancestry == wc->ancestry) {
+        *n = e->w.n_ancestors;
+        return e->w.ancestors;
+    }
+
+    Window as[MAX_DEPTH];
+    size_t k = 0;
+    const Window self = w->window, root = w->root;
+    Window xw = w->parent;
+    while(xw != None && xw != root) {
+        if(k == MAX_DEPTH) {
+            warning("window %lu: ancestor chain deeper than %d",
+                    self, MAX_DEPTH);
+            break;
+        }
+
+        const struct window* p = window_get_class(st, xw);
+        if(p == NULL) {
+            warning("x11_window(%lu) failed", xw);
+            break;
+        }
+
+        as[k++] = xw;
+        xw = p->parent;
+    }
+    debug("window %lu: %zu ancestors", self, k);
+
+    // the lookups above may have reused the scratch window
+    e = window_cache_find(wc, self);
+    if(e == NULL) {
+        memcpy(wc->scratch_ancestors, as, k * sizeof(Window));
+        *n = k;
+        return wc->scratch_ancestors;
+    }
+
+    memcpy(e->w.ancestors, as, k * sizeof(Window));
+    e->w.n_ancestors = *n = k;
+    e->w.ancestry = wc->ancestry;
+    return e->w.ancestors;
+}
+
+static void window_cache_invalidate(struct state* st, Window w)
+{
+    struct window_cache_entry* e = window_cache_find(st->wc, w);
+    if(e != NULL) {
+        debug("window cache: invalidating %lu", w);
+        window_cache_unlink(st, e);
+        st->wc->invalidations += 1;
+    }
+}
+
+// keep destroyed windows from being predicted
+static void history_forget(struct state* st, Window w)
+{
+    size_t n = 0, first = (st->history.head + HISTORY_SIZE
+                           - st->history.n) % HISTORY_SIZE;
+    for(size_t k = 0; k < st->history.n; k++) {
+        size_t i = (first + k) % HISTORY_SIZE;
+        if(st->history.ring[i].from != w && st->history.ring[i].to != w) {
+            st->history.ring[(first + n++) % HISTORY_SIZE]
+                = st->history.ring[i];
+        }
+    }
+    st->history.head = (first + n) % HISTORY_SIZE;
+    st->history.n = n;
+
+    if(st->history.last == w) {
+        st->history.last = None;
+    }
+}
+
+static void window_destroyed(struct state* st, Window w)
+{
+    rec_window_id(st, REC_DESTROY, w);
+    window_cache_invalidate(st, w);
+    history_forget(st, w);
+    if(w == st->cursor.window) {
+        // shown, if need be, with the next focus change
+        debug("cursor window destroyed: %lu", w);
+        st->cursor.window = None;
+    }
+}
+
+static void window_reparented(struct state* st, Window w, Window parent)
+{
+    uint64_t v[2] = { w, parent };
+    rec_write(st, REC_REPARENT, v, sizeof(v));
+
+    struct window_cache_entry* e = window_cache_find(st->wc, w);
+    if(e != NULL) {
+        debug("window %lu reparented: %lu", w, parent);
+        e->w.parent = parent;
+        st->wc->ancestry += 1;
+    }
+}
+
+static int window_cache_handle_event(struct state* st, const XEvent* ev)
+{
+    if(ev->type == PropertyNotify) {
+        const XPropertyEvent* p = &ev->xproperty;
+        if(p->atom == st->net_wm_name
+           || p->atom == st->wm_name
+           || p->atom == st->wm_class
+           || p->atom == st->net_wm_pid
+           || p->atom == st->net_wm_window_type
+           || p->atom == XA_WM_TRANSIENT_FOR) {
+            rec_window_id(st, REC_INVALIDATE, p->window);
+            window_cache_invalidate(st, p->window);
+        }
+        return 1;
+    } else if(ev->type == DestroyNotify) {
+        window_destroyed(st, ev->xdestroywindow.window);
+        return 1;
+    } else if(ev->type == ReparentNotify) {
+        window_reparented(st, ev->xreparent.window, ev->xreparent.parent);
+        return 1;
+    } else if(ev->type == ConfigureNotify
+              || ev->type == MapNotify
+              || ev->type == UnmapNotify
+              || ev->type == GravityNotify
+              || ev->type == CirculateNotify) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static int window_has_class(const struct window* w, sym_t cls)
+{
+    for(size_t i = 0; i < w->n_class; i++) {
+        if(w->class[i] == cls) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int window_has_class_rec(const struct state* st,
+                                const struct window* w, sym_t cls)
+{
+    if(window_has_class(w, cls)) {
+        return 1;
+    }
+
+    size_t n;
+    const Window* as = window_ancestors(st, w, &n);
+    for(size_t i = 0; i < n; i++) {
+        const struct window* p = window_get_class(st, as[i]);
+        if(p == NULL) {
+            warning("x11_window(%lu) failed", as[i]);
+            return 0;
+        }
+
+        if(window_has_class(p, cls)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int x11_window_prop_window(const struct state* st, Window w,
+                                  Atom p, Window* v)
+{
+    Atom t = None;
+    int fmt;
+    unsigned long nitems, remaining;
+    unsigned char* b = NULL;
+    stats_roundtrip(st);
+    int res = XGetWindowProperty(st->dpy, w, p,
+                                 0L, 1L,
+                                 False /* delete */,
+                                 XA_WINDOW /* req_type */,
+                                 &t /* actual_type */,
+                                 &fmt, &nitems, &remaining, &b);
+
+    if(res != Success) {
+        debug("XGetWindowProperty(%lu, %s) failed",
+              w, atom_name(st, p));
+        return -1;
+    }
+
+    if(t == XA_WINDOW && fmt == 32 && nitems == 1) {
+        *v = *(Window*)b;
+    } else {
+        *v = None;
+    }
+
+    if(b != NULL) {
+        XFree(b);
+    }
+    return 0;
+}
+
+// EWMH compliance: a live _NET_SUPPORTING_WM_CHECK window pointing back to
+// itself and _NET_ACTIVE_WINDOW advertised in _NET_SUPPORTED
+static int x11_ewmh_check(const struct state* st)
+{
+    Window wm, wm2;
+    if(x11_window_prop_window(st, st->parent,
+                              st->net_supporting_wm_check, &wm) != 0
+       || wm == None) {
+        debug("no _NET_SUPPORTING_WM_CHECK window");
+        return 0;
+    }
+
+    if(x11_window_prop_window(st, wm, st->net_supporting_wm_check, &wm2) != 0
+       || wm2 != wm) {
+        debug("stale _NET_SUPPORTING_WM_CHECK window: %lu", wm);
+        return 0;
+    }
+
+    Atom t = None;
+    int fmt;
+    unsigned long nitems, remaining;
+    unsigned char* b = NULL;
+    stats_roundtrip(st);
+    int res = XGetWindowProperty(st->dpy, st->parent, st->net_supported,
+                                 0L, 4096L,
+                                 False /* delete */,
+                                 XA_ATOM /* req_type */,
+                                 &t /* actual_type */,
+                                 &fmt, &nitems, &remaining, &b);
+    if(res != Success) {
+        debug("XGetWindowProperty(%lu, _NET_SUPPORTED) failed", st->parent);
+        return 0;
+    }
+
+    int supported = 0;
+    if(t == XA_ATOM && fmt == 32) {
+        const Atom* as = (const Atom*)b;
+        for(unsigned long i = 0; i < nitems; i++) {
+            if(as[i] == st->net_active_window) {
+                supported = 1;
+                break;
+            }
+        }
+    }
+
+    if(b != NULL) {
+        XFree(b);
+    }
+
+    if(!supported) {
+        debug("_NET_ACTIVE_WINDOW not in _NET_SUPPORTED");
+    }
+    return supported;
+}
+
+static Window x11_query_current_window(const struct state* st)
+{
+    Window w;
+    if(st->ewmh) {
+        if(x11_window_prop_window(st, st->focus_root,
+                                  st->net_active_window, &w) == 0
+           && w != None) {
+            trace("active window: %lu (%lx)", w, w);
+            return w;
+        }
+    }
+
+    int rt;
+    stats_roundtrip(st);
+    if(XGetInputFocus(st->dpy, &w, &rt) != 1) {
+        warning("XGetInputFocus failed");
+        return None; // the display may be gone: picked up by the main loop
+    }
+    trace("focused window: %lu (%lx)", w, w);
+    return w;
+}
+
+static Window x11_current_window(const struct state* st)
+{
+    if(replaying(st)) {
+        return replay_current(st);
+    }
+
+    Window w = x11_query_current_window(st);
+    rec_window_id(st, REC_CURRENT, w);
+    return w;
+}
+
+struct xkb_layout {
+    layout_t layout;
+    // XKB component expressions, NULL keeps the server's current component
+    const char* keycodes, * types, * compat, * symbols;
+};
+
+enum rule_match {
+    CLASS,
+    CLASS_REC,
+    NAME,
+    EXE, // basename of the executable of the window's _NET_WM_PID
+};
+
+struct rule {
+    enum rule_match match;
+    const char* pattern; // fnmatch(3) pattern if it contains any of *?[
+    layout_t layout;
+    int hide_cursor;
+};
+
+struct decision {
+    layout_t layout;
+    int hide_cursor;
+};
+
+#include "config.h"
+
+static size_t window_filter_types(const char*** names)
+{
+    *names = skip_window_types;
+    return MIN(LENGTH(skip_window_types), SKIP_TYPES_MAX);
+}
+
+// the atoms of the window_filter_types, interned (created if need be) in
+// the one batch with the rest
+static void window_filter_init(struct state* st, const Atom* as, size_t n)
+{
+    if(n < LENGTH(skip_window_types)) {
+        warning("only the first %zu skip_window_types are used", n);
+    }
+
+    st->skip_transient = skip_transient;
+    st->n_skip_types = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(as[i] != None) {
+            st->skip_types[st->n_skip_types++] = as[i];
+        }
+    }
+}
+
+// dialogs, notifications and the like keep the focused window's layout
+static int window_skipped(const struct state* st, const struct window* w)
+{
+    if(st->skip_transient && w->transient) {
+        debug("skipping transient window %lu", w->window);
+        return 1;
+    }
+
+    for(size_t i = 0; w->type != None && i < st->n_skip_types; i++) {
+        if(w->type == st->skip_types[i]) {
+            debug("skipping window %lu: %s",
+                  w->window, atom_name(st, w->type));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// subscribers: $XDG_RUNTIME_DIR/xhook.sock streams one tab separated line
+// per change, with tabs, newlines and backslashes escaped:
+//   focus DISPLAY WINDOW CLASS NAME
+//   layout DISPLAY LAYOUT
+// starting with the current state of every display. Records are written
+// as they happen: a client whose socket and buffer have both filled up is
+// disconnected rather than waited for
+
+struct record {
+    size_t len;
+    char buf[1024];
+};
+
+static void record_str(struct record* r, const char* s)
+{
+    const size_t room = sizeof(r->buf) - 1; // for the newline
+    if(r->len > 0 && r->len < room) {
+        r->buf[r->len++] = '\t';
+    }
+
+    for(; *s != '\0'; s++) {
+        char e = *s == '\t' ? 't' : *s == '\n' ? 'n'
+            : *s == '\r' ? 'r' : *s == '\\' ? '\\' : 0;
+        if(r->len + (e ? 2 : 1) > room) {
+            break;
+        }
+        if(e) {
+            r->buf[r->len++] = '\\';
+            r->buf[r->len++] = e;
+        } else {
+            r->buf[r->len++] = *s;
+        }
+    }
+}
+
+static void record_focus(struct record* r, const struct state* st)
+{
+    const struct xhook_status* s = st->status;
+    char w[32];
+    snprintf(LIT(w), "%lu", (unsigned long)s->window);
+
+    r->len = 0;
+    record_str(r, "focus");
+    record_str(r, DisplayString(st->dpy));
+    record_str(r, w);
+    record_str(r, s->class);
+    record_str(r, s->name);
+    r->buf[r->len++] = '\n';
+}
+
+static void record_layout(struct record* r, const struct state* st)
+{
+    r->len = 0;
+    record_str(r, "layout");
+    record_str(r, DisplayString(st->dpy));
+    record_str(r, st->status->layout);
+    r->buf[r->len++] = '\n';
+}
+
+static void subscribers_init(struct xhook* x)
+{
+    x->subs.fd = -1;
+    x->subs.path = NULL;
+    x->subs.n = 0;
+
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    if(dir == NULL) {
+        return;
+    }
+
+    struct sockaddr_un a = { .sun_family = AF_UNIX };
+    int r = snprintf(LIT(a.sun_path), "%s/xhook.sock", dir);
+    if(r < 0 || (size_t)r >= sizeof(a.sun_path)) {
+        warning("not accepting subscribers: path too long: %s", dir);
+        return;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    CHECK(fd, "socket");
+
+    r = bind(fd, (struct sockaddr*)&a, sizeof(a));
+    if(r == -1 && errno == EADDRINUSE) {
+        // left behind unless another xhook is still listening
+        if(connect(fd, (struct sockaddr*)&a, sizeof(a)) == 0) {
+            warning("not accepting subscribers: %s in use", a.sun_path);
+            r = close(fd); CHECK(r, "close");
+            return;
+        }
+        r = close(fd); CHECK(r, "close");
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        CHECK(fd, "socket");
+        r = unlink(a.sun_path); CHECK(r, "unlink(%s)", a.sun_path);
+        r = bind(fd, (struct sockaddr*)&a, sizeof(a));
+    }
+    CHECK(r, "bind(%s)", a.sun_path);
+
+    r = listen(fd, SUBSCRIBERS_MAX); CHECK(r, "listen");
+
+    x->subs.fd = fd;
+    x->subs.path = strdup(a.sun_path); CHECK_MALLOC(x->subs.path);
+    debug("accepting subscribers: %s", x->subs.path);
+}
+
+static void subscriber_drop(struct xhook* x, size_t i)
+{
+    // children may not have closed their copy of the socket yet
+    if(x->subs.clients[i].polled) {
+        int r = epoll_ctl(x->epfd, EPOLL_CTL_DEL, x->subs.clients[i].fd, NULL);
+        CHECK(r, "epoll_ctl(%d)", x->subs.clients[i].fd);
+    }
+    int r = close(x->subs.clients[i].fd); CHECK(r, "close");
+    debug("subscriber %d gone", x->subs.clients[i].fd);
+    x->subs.clients[i] = x->subs.clients[--x->subs.n];
+}
+
+static void subscribers_deinit(struct xhook* x)
+{
+    if(x->subs.fd < 0) {
+        return;
+    }
+
+    while(x->subs.n > 0) {
+        subscriber_drop(x, x->subs.n - 1);
+    }
+
+    int r = close(x->subs.fd); CHECK(r, "close");
+    x->subs.fd = -1;
+
+    r = unlink(x->subs.path); CHECK(r, "unlink(%s)", x->subs.path);
+    free(x->subs.path);
+    x->subs.path = NULL;
+}
+
+static int subscribers_fd(const struct xhook* x)
+{
+    return x->subs.fd;
+}
+
+// a client with a backlog is flushed once its socket takes more
+static void subscriber_poll(struct xhook* x, struct subscriber* c)
+{
+    int want = c->len > 0;
+    if(want == c->polled || x->subs.writable == NULL) {
+        return;
+    }
+
+    struct epoll_event e = { .events = EPOLLOUT, .data.ptr = x->subs.writable };
+    int r = epoll_ctl(x->epfd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, c->fd, &e);
+    CHECK(r, "epoll_ctl(%d)", c->fd);
+    c->polled = want;
+}
+
+// write what the socket takes: returns 0 if the subscriber had to be
+// dropped
+static int subscriber_flush(struct xhook* x, size_t i)
+{
+    struct subscriber* c = &x->subs.clients[i];
+    ssize_t n = send(c->fd, c->buf, c->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        n = 0;
+    } else if(n == -1 && (errno == EPIPE || errno == ECONNRESET)) {
+        subscriber_drop(x, i);
+        return 0;
+    } else if(n == -1) {
+        // whatever went wrong, it is no reason to stop tracking the focus
+        warning("send(subscriber %d): %s", c->fd, strerror(errno));
+        subscriber_drop(x, i);
+        return 0;
+    }
+
+    c->len -= n;
+    memmove(c->buf, c->buf + n, c->len);
+    subscriber_poll(x, c);
+    return 1;
+}
+
+// queue the record and write what the socket takes: returns 0 if the
+// subscriber had to be dropped
+static int subscriber_send(struct xhook* x, size_t i, const struct record* r)
+{
+    struct subscriber* c = &x->subs.clients[i];
+    if(c->len + r->len > sizeof(c->buf)) {
+        warning("subscriber %d not keeping up: disconnecting", c->fd);
+        subscriber_drop(x, i);
+        return 0;
+    }
+    memcpy(c->buf + c->len, r->buf, r->len);
+    c->len += r->len;
+
+    return subscriber_flush(x, i);
+}
+
+// some client with a backlog can take more
+static void subscribers_writable(struct xhook* x)
+{
+    for(size_t i = 0; i < x->subs.n;) {
+        i += x->subs.clients[i].len == 0 || subscriber_flush(x, i);
+    }
+}
+
+static void subscribers_send(struct xhook* x, const struct record* r)
+{
+    for(size_t i = 0; i < x->subs.n;) {
+        i += subscriber_send(x, i, r);
+    }
+}
+
+static void subscribers_focus(struct state* st)
+{
+    if(st->x->subs.n > 0) {
+        struct record r;
+        record_focus(&r, st);
+        subscribers_send(st->x, &r);
+    }
+}
+
+static void subscribers_layout(struct state* st)
+{
+    if(st->x->subs.n > 0) {
+        struct record r;
+        record_layout(&r, st);
+        subscribers_send(st->x, &r);
+    }
+}
+
+static void subscribers_accept(struct xhook* x)
+{
+    for(;;) {
+        int fd = accept(x->subs.fd, NULL, NULL);
+        if(fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        CHECK(fd, "accept");
+
+        if(x->subs.n >= SUBSCRIBERS_MAX) {
+            warning("too many subscribers: rejecting %d", fd);
+            int r = close(fd); CHECK(r, "close");
+            continue;
+        }
+
+        // kept out of the hooks
+        int r = fcntl(fd, F_SETFD, FD_CLOEXEC); CHECK(r, "fcntl");
+        set_blocking(fd, 0);
+
+        size_t i = x->subs.n++;
+        x->subs.clients[i] = (struct subscriber) { .fd = fd };
+        debug("subscriber %d connected", fd);
+
+        for(size_t j = 0; j < x->n; j++) {
+            if(x->displays[j].status == NULL) {
+                continue;
+            }
+
+            struct record r;
+            record_focus(&r, &x->displays[j]);
+            if(!subscriber_send(x, i, &r)) {
+                break;
+            }
+            record_layout(&r, &x->displays[j]);
+            if(!subscriber_send(x, i, &r)) {
+                break;
+            }
+        }
+    }
+}
+
+static void status_init(struct state* st)
+{
+    st->status = NULL;
+    st->status_path = NULL;
+
+    char path[4096];
+    if(xhook_status_path(LIT(path), DisplayString(st->dpy)) != 0) {
+        warning("not publishing status: XDG_RUNTIME_DIR not set");
+        return;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    CHECK(fd, "open(%s)", path);
+    int r = ftruncate(fd, sizeof(*st->status)); CHECK(r, "ftruncate");
+
+    st->status = mmap(NULL, sizeof(*st->status), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    CHECK_MMAP(st->status);
+    r = close(fd); CHECK(r, "close");
+
+    // readers spin on an odd sequence number: start from a clean slate
+    memset(st->status, 0, sizeof(*st->status));
+    __atomic_store_n(&st->status->magic, XHOOK_STATUS_MAGIC, __ATOMIC_RELEASE);
+
+    st->status_path = strdup(path); CHECK_MALLOC(st->status_path);
+    debug("publishing status: %s", path);
+}
+
+static void status_deinit(struct state* st)
+{
+    if(st->status == NULL) {
+        return;
+    }
+
+    int r = unlink(st->status_path); CHECK(r, "unlink(%s)", st->status_path);
+    free(st->status_path);
+    st->status_path = NULL;
+
+    r = munmap(st->status, sizeof(*st->status)); CHECK(r, "munmap");
+    st->status = NULL;
+}
+
+static void status_begin(struct xhook_status* s)
+{
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// the one system call per update: waking readers blocked on the futex
+static void status_end(struct xhook_status* s)
+{
+    s->generation += 1;
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+    long r = syscall(SYS_futex, &s->seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+    CHECK(r, "futex(FUTEX_WAKE)");
+}
+
+static void status_window(struct state* st, const struct window* w)
+{
+    struct xhook_status* s = st->status;
+    if(s == NULL) {
+        return;
+    }
+
+    status_begin(s);
+    if(w != NULL) {
+        s->window = w->window;
+        snprintf(LIT(s->class), "%s", w->n_class == 0 ? ""
+                 : sym_str(st->x->syms, w->class[w->n_class - 1]));
+        snprintf(LIT(s->name), "%s", w->name);
+    } else {
+        s->window = 0;
+        s->class[0] = '\0';
+        s->name[0] = '\0';
+    }
+    status_end(s);
+
+    subscribers_focus(st);
+}
+
+static void status_layout(struct state* st)
+{
+    struct xhook_status* s = st->status;
+    if(s == NULL) {
+        return;
+    }
+
+    status_begin(s);
+    snprintf(LIT(s->layout), "%s", st->layout ? st->layout : "");
+    status_end(s);
+
+    subscribers_layout(st);
+}
+
+static void xkb_init(struct state* st)
+{
+    st->xkb.n = LENGTH(xkb_layouts);
+    if(st->xkb.n == 0) {
+        return;
+    }
+
+    int major = XkbMajorVersion, minor = XkbMinorVersion;
+    int opcode, event, err;
+    stats_roundtrip(st);
+    if(!XkbQueryExtension(st->dpy, &opcode, &event, &err, &major, &minor)) {
+        warning("XKB extension not available: using keymap for all layouts");
+        st->xkb.n = 0;
+        return;
+    }
+
+    st->xkb.descs = calloc(st->xkb.n, sizeof(XkbDescPtr));
+    CHECK_MALLOC(st->xkb.descs);
+
+    for(size_t i = 0; i < st->xkb.n; i++) {
+        const struct xkb_layout* x = &xkb_layouts[i];
+
+        // "%" refers to the component of the server's current keymap
+        XkbComponentNamesRec names = {
+            .keycodes = (char*)(x->keycodes ? x->keycodes : "%"),
+            .types = (char*)(x->types ? x->types : "%"),
+            .compat = (char*)(x->compat ? x->compat : "%"),
+            .symbols = (char*)(x->symbols ? x->symbols : "%"),
+        };
+
+        const unsigned int need = XkbGBN_TypesMask
+            | XkbGBN_CompatMapMask
+            | XkbGBN_ClientSymbolsMask
+            | XkbGBN_ServerSymbolsMask;
+        stats_roundtrip(st);
+        XkbDescPtr d = XkbGetKeyboardByName(st->dpy, XkbUseCoreKbd, &names,
+                                            need, need, False);
+        if(d == NULL) {
+            warning("unable to load XKB keymap for layout %s (symbols: %s): "
+                    "falling back to keymap", x->layout, names.symbols);
+            continue;
+        }
+
+        info("loaded XKB keymap for layout %s (symbols: %s)",
+             x->layout, names.symbols);
+        st->xkb.descs[i] = d;
+    }
+}
+
+static void xkb_deinit(struct state* st)
+{
+    // bounded by the table too: it may well be empty
+    for(size_t i = 0; i < st->xkb.n && i < LENGTH(xkb_layouts); i++) {
+        if(st->xkb.descs[i] != NULL) {
+            XkbFreeKeyboard(st->xkb.descs[i], 0, True);
+        }
+    }
+    free(st->xkb.descs);
+    st->xkb.descs = NULL;
+    st->xkb.n = 0;
+}
+
+static XkbDescPtr xkb_keymap(const struct state* st, const layout_t l)
+{
+    // bounded by the table too: it may well be empty
+    for(size_t i = 0; i < st->xkb.n && i < LENGTH(xkb_layouts); i++) {
+        if(st->xkb.descs[i] != NULL
+           && strcmp(xkb_layouts[i].layout, l) == 0) {
+            return st->xkb.descs[i];
+        }
+    }
+    return NULL;
+}
+
+// upload a preloaded keymap: a few one-way requests, no reply to wait for
+static void xkb_switch(struct state* st, const layout_t l, XkbDescPtr d)
+{
+    uint64_t t0 = now_ns();
+    d->device_spec = XkbUseCoreKbd;
+    if(!XkbSetMap(st->dpy, XkbAllMapComponentsMask, d)) {
+        warning("XkbSetMap(%s) failed", l);
+        return;
+    }
+    XkbSetCompatMap(st->dpy, XkbSymInterpMask | XkbGroupCompatMask, d, True);
+    XkbLockGroup(st->dpy, XkbUseCoreKbd, XkbGroup1Index);
+
+    info("switched layout: %s (xkb)", l);
+    st->layout = l;
+    status_layout(st);
+
+    uint64_t t1 = now_ns();
+    st->stats->xkb_switches += 1;
+    histogram_add(&st->stats->hook, t1 - t0);
+    if(st->focus.t_served != 0) {
+        histogram_add(&st->stats->focus_to_hook, t1 - st->focus.t_served);
+    }
+}
+
+// queue st's task unless already queued
+static void task_defer(struct state* st, void (*run)(struct state*))
+{
+    struct xhook* x = st->x;
+    for(size_t i = 0; i < x->runq.n; i++) {
+        const struct task* t =
+            &x->runq.tasks[(x->runq.head + i) % RUN_QUEUE_SIZE];
+        if(t->run == run && t->st == st) {
+            return;
+        }
+    }
+
+    if(x->runq.n == RUN_QUEUE_SIZE) {
+        warning("run queue full: running task now");
+        run(st);
+        return;
+    }
+
+    x->runq.tasks[(x->runq.head + x->runq.n++) % RUN_QUEUE_SIZE] =
+        (struct task) { .run = run, .st = st };
+}
+
+// drop st's queued tasks, keeping the others in order
+static void task_cancel(struct state* st)
+{
+    struct xhook* x = st->x;
+    size_t n = 0;
+    for(size_t k = 0; k < x->runq.n; k++) {
+        size_t i = (x->runq.head + k) % RUN_QUEUE_SIZE;
+        if(x->runq.tasks[i].st != st) {
+            x->runq.tasks[(x->runq.head + n++) % RUN_QUEUE_SIZE]
+                = x->runq.tasks[i];
+        }
+    }
+    x->runq.n = n;
+}
+
+static int task_run(struct xhook* x)
+{
+    if(x->runq.n == 0) {
+        return 0;
+    }
+
+    struct task t = x->runq.tasks[x->runq.head];
+    x->runq.head = (x->runq.head + 1) % RUN_QUEUE_SIZE;
+    x->runq.n -= 1;
+
+    t.run(t.st);
+    return 1;
+}
+
+extern char** environ;
+
+// the environment of xhook, with DISPLAY pointing at the hook's display
+static void hook_env_init(struct state* st)
+{
+    size_t n = 0;
+    while(environ[n] != NULL) n++;
+
+    st->env = calloc(n + 2, sizeof(char*));
+    CHECK_MALLOC(st->env);
+
+    size_t j = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(strncmp(environ[i], "DISPLAY=", 8) != 0) {
+            st->env[j++] = environ[i];
+        }
+    }
+
+    const char* d = XDisplayString(st->dpy);
+    char* e = st->env[j++] = malloc(8 + strlen(d) + 1);
+    CHECK_MALLOC(e);
+    strcpy(e, "DISPLAY=");
+    strcat(e, d);
+    st->env[j] = NULL;
+}
+
+static void hook_env_deinit(struct state* st)
+{
+    if(st->env == NULL) {
+        return;
+    }
+
+    size_t n = 0;
+    while(st->env[n + 1] != NULL) n++;
+    free(st->env[n]); // the DISPLAY entry is always last
+    free(st->env);
+    st->env = NULL;
+}
+
+static void hook_spawn(struct state* st, const layout_t l)
+{
+    char* const argv[] = { "keymap", (char*)l, NULL };
+
+    // the signals xhook handles through its signalfd are blocked
+    posix_spawnattr_t a;
+    int r = posix_spawnattr_init(&a);
+    if(r != 0) {
+        errno = r;
+        CHECK(-1, "posix_spawnattr_init");
+    }
+
+    sigset_t m;
+    sigemptyset(&m);
+    posix_spawnattr_setsigmask(&a, &m);
+    posix_spawnattr_setflags(&a, POSIX_SPAWN_SETSIGMASK);
+
+    debug("running: keymap %s", l);
+    pid_t pid;
+    r = posix_spawnp(&pid, argv[0], NULL, &a, argv, st->env);
+    posix_spawnattr_destroy(&a);
+    if(r != 0) {
+        warning("unable to run keymap %s: %s", l, strerror(r));
+        return;
+    }
+
+    trace("keymap %s: pid %d", l, pid);
+    st->stats->spawns += 1;
+    st->hook.t_spawn = now_ns();
+    st->hook.t_focus = st->focus.t_served;
+    st->hook.pid = pid;
+    st->hook.running = l;
+    st->hook.stale = 0;
+}
+
+static void set_layout(struct state* st, const layout_t l)
+{
+    if(st->hook.pid != 0) {
+        if(l == st->hook.running && !st->hook.stale) {
+            st->hook.pending = NULL;
+        } else {
+            debug("keymap %s still running: deferring %s",
+                  st->hook.running, l);
+            st->hook.pending = l;
+        }
+        return;
+    }
+
+    st->hook.pending = NULL;
+    if(st->layout == l) {
+        return;
+    }
+
+    if(replaying(st)) {
+        info("switched layout: %s (replay)", l);
+        st->layout = l;
+        if(st->focus.t_served != 0) {
+            histogram_add(&st->stats->focus_to_hook,
+                          now_ns() - st->focus.t_served);
+        }
+        return;
+    }
+
+    XkbDescPtr d = xkb_keymap(st, l);
+    if(d != NULL) {
+        xkb_switch(st, l, d);
+    } else {
+        hook_spawn(st, l);
+    }
+}
+
+// forget the current layout so that the next set_layout applies it again
+static void reset_layout(struct state* st)
+{
+    debug("resetting layout");
+    st->layout = NULL;
+    if(st->hook.pid != 0) {
+        st->hook.stale = 1;
+    }
+}
+
+static void hook_apply_pending(struct state* st)
+{
+    const layout_t p = st->hook.pending;
+    if(p != NULL) {
+        set_layout(st, p);
+    }
+}
+
+static void hook_reaped(struct state* st, int ws)
+{
+    const layout_t l = st->hook.running;
+    st->hook.pid = 0;
+    st->hook.running = NULL;
+
+    if(WIFEXITED(ws) && WEXITSTATUS(ws) == 0) {
+        if(st->hook.stale) {
+            debug("keymap %s finished after a reset", l);
+        } else {
+            info("switched layout: %s", l);
+            st->layout = l;
+            status_layout(st);
+
+            uint64_t t = now_ns();
+            histogram_add(&st->stats->hook, t - st->hook.t_spawn);
+            if(st->hook.t_focus != 0) {
+                histogram_add(&st->stats->focus_to_hook,
+                              t - st->hook.t_focus);
+            }
+        }
+    } else if(WIFEXITED(ws)) {
+        warning("changing to layout %s failed with exit code: %d",
+                l, WEXITSTATUS(ws));
+    } else {
+        warning("changing to layout %s failed: status=%d", l, ws);
+    }
+
+    if(st->hook.pending != NULL) {
+        task_defer(st, hook_apply_pending);
+    }
+}
+
+static void hook_reap(struct xhook* x)
+{
+    while(1) {
+        int ws;
+        pid_t pid = waitpid(-1, &ws, WNOHANG);
+        if(pid == 0 || (pid == -1 && errno == ECHILD)) {
+            break;
+        }
+        CHECK(pid, "waitpid");
+
+        struct state* st = NULL;
+        for(size_t i = 0; i < x->n; i++) {
+            if(x->displays[i].hook.pid == pid) {
+                st = &x->displays[i];
+                break;
+            }
+        }
+
+        if(st == NULL) {
+            warning("reaped unknown child: %d", pid);
+            continue;
+        }
+
+        hook_reaped(st, ws);
+    }
+}
+
+#define RULE_NONE SIZE_MAX
+
+static int rule_is_wildcard(const struct rule* r)
+{
+    return strpbrk(r->pattern, "*?[") != NULL;
+}
+
+static layout_t layout_intern(struct symtab* syms, layout_t l)
+{
+    return l == NULL ? NULL : sym_str(syms, sym_intern(syms, STR(l)));
+}
+
+static void rules_compile(struct symtab* syms, struct ruleset* rs,
+                          const struct rule* rules, size_t n,
+                          layout_t default_layout)
+{
+    rs->rules = calloc(MAX(n, 1), sizeof(struct rule));
+    CHECK_MALLOC(rs->rules);
+    for(size_t i = 0; i < n; i++) {
+        rs->rules[i] = rules[i];
+        rs->rules[i].pattern = layout_intern(syms, rules[i].pattern);
+        rs->rules[i].layout = layout_intern(syms, rules[i].layout);
+    }
+    rules = rs->rules;
+    rs->n = n;
+    rs->default_layout = layout_intern(syms, default_layout);
+
+    static unsigned int generation = 0;
+    rs->generation = ++generation;
+    rs->recursive = 0;
+    rs->exe = 0;
+
+    rs->syms = calloc(MAX(n, 1), sizeof(sym_t));
+    CHECK_MALLOC(rs->syms);
+    rs->next = calloc(MAX(n, 1), sizeof(size_t));
+    CHECK_MALLOC(rs->next);
+    rs->fallbacks = calloc(MAX(n, 1), sizeof(size_t));
+    CHECK_MALLOC(rs->fallbacks);
+    rs->n_fallbacks = 0;
+
+    for(size_t i = 0; i < n; i++) {
+        const struct rule* r = &rules[i];
+        if(!rule_is_wildcard(r)) {
+            rs->syms[i] = sym_intern(syms, STR(r->pattern));
+        }
+        if(r->match == CLASS_REC || rule_is_wildcard(r)) {
+            rs->fallbacks[rs->n_fallbacks++] = i;
+        }
+        rs->recursive |= r->match == CLASS_REC;
+        rs->exe |= r->match == EXE;
+    }
+
+    rs->n_syms = syms->n;
+    rs->by_class = malloc(rs->n_syms * sizeof(size_t));
+    CHECK_MALLOC(rs->by_class);
+    rs->by_name = malloc(rs->n_syms * sizeof(size_t));
+    CHECK_MALLOC(rs->by_name);
+    rs->by_exe = malloc(rs->n_syms * sizeof(size_t));
+    CHECK_MALLOC(rs->by_exe);
+    for(size_t x = 0; x < rs->n_syms; x++) {
+        rs->by_class[x] = rs->by_name[x] = rs->by_exe[x] = RULE_NONE;
+    }
+
+    size_t indexed = 0;
+    for(size_t i = n; i-- > 0;) {
+        const struct rule* r = &rules[i];
+        size_t* by = r->match == CLASS ? rs->by_class
+            : r->match == NAME ? rs->by_name
+            : r->match == EXE ? rs->by_exe : NULL;
+        if(by == NULL || rs->syms[i] == SYM_NONE) {
+            continue;
+        }
+
+        rs->next[i] = by[rs->syms[i]];
+        by[rs->syms[i]] = i;
+        indexed += 1;
+    }
+
+    info("compiled %zu rules: %zu indexed, %zu evaluated in order",
+         n, indexed, rs->n_fallbacks);
+}
+
+static void rules_free(struct ruleset* rs)
+{
+    free(rs->rules);
+    free(rs->syms);
+    free(rs->next);
+    free(rs->by_class);
+    free(rs->by_name);
+    free(rs->by_exe);
+    free(rs->fallbacks);
+    *rs = (struct ruleset){ 0 };
+}
+
+struct rules_match {
+    size_t layout, cursor;
+};
+
+static void rules_consider(const struct ruleset* rs, size_t i,
+                           struct rules_match* m)
+{
+    const struct rule* r = &rs->rules[i];
+    if(r->layout != NULL && i < m->layout) {
+        m->layout = i;
+    }
+    if(r->hide_cursor && i < m->cursor) {
+        m->cursor = i;
+    }
+}
+
+static void rules_lookup(const struct ruleset* rs, const size_t* by,
+                         sym_t x, struct rules_match* m)
+{
+    if(x >= rs->n_syms) {
+        return;
+    }
+
+    for(size_t i = by[x]; i != RULE_NONE; i = rs->next[i]) {
+        rules_consider(rs, i, m);
+    }
+}
+
+static int class_fnmatch(const struct state* st, const char* pattern,
+                         const struct window* w)
+{
+    for(size_t i = 0; i < w->n_class; i++) {
+        if(fnmatch(pattern, sym_str(st->x->syms, w->class[i]), 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int rule_matches(const struct state* st, const struct ruleset* rs,
+                        size_t i, const struct window* w)
+{
+    const struct rule* r = &rs->rules[i];
+    if(r->match == NAME) {
+        return fnmatch(r->pattern, w->name, 0) == 0;
+    }
+
+    if(r->match == EXE) {
+        return fnmatch(r->pattern, sym_str(st->x->syms, w->exe), 0) == 0;
+    }
+
+    if(r->match == CLASS_REC && rs->syms[i] != SYM_NONE) {
+        return window_has_class_rec(st, w, rs->syms[i]);
+    }
+
+    if(class_fnmatch(st, r->pattern, w)) {
+        return 1;
+    }
+
+    if(r->match == CLASS_REC) {
+        size_t n;
+        const Window* as = window_ancestors(st, w, &n);
+        for(size_t k = 0; k < n; k++) {
+            const struct window* p = window_get_class(st, as[k]);
+            if(p != NULL && class_fnmatch(st, r->pattern, p)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// first matching rule wins, separately for the layout and the cursor:
+// hashed lookups for the window's classes and name, then the remaining
+// rules only as long as they could still beat what has been found
+static void rules_decide_with(const struct state* st,
+                              const struct ruleset* rs,
+                              const struct window* w, struct decision* d)
+{
+    struct rules_match m = { .layout = RULE_NONE, .cursor = RULE_NONE };
+
+    for(size_t i = 0; i < w->n_class; i++) {
+        rules_lookup(rs, rs->by_class, w->class[i], &m);
+    }
+    rules_lookup(rs, rs->by_name, sym_find(st->x->syms, w->name), &m);
+    rules_lookup(rs, rs->by_exe, w->exe, &m);
+
+    for(size_t k = 0; k < rs->n_fallbacks; k++) {
+        size_t i = rs->fallbacks[k];
+        if(i > m.layout && i > m.cursor) {
+            break;
+        }
+
+        const struct rule* r = &rs->rules[i];
+        int useful = (r->layout != NULL && i < m.layout)
+            || (r->hide_cursor && i < m.cursor);
+        if(useful && rule_matches(st, rs, i, w)) {
+            trace("window %lu matched rule %zu: %s", w->window, i, r->pattern);
+            rules_consider(rs, i, &m);
+        }
+    }
+
+    d->layout = m.layout != RULE_NONE
+        ? rs->rules[m.layout].layout : rs->default_layout;
+    d->hide_cursor = m.cursor != RULE_NONE;
+}
+
+// decisions depend only on the classes and name of a window, and of its
+// ancestors when there are CLASS_REC rules: switching back and forth
+// between the same windows is then decided by a lookup
+#define DECISION_CACHE_SIZE 32
+
+struct decision_key {
+    unsigned int generation;
+    uint8_t n_class;
+    sym_t class[MAX_CLASS];
+    uint16_t name_len;
+    sym_t exe;
+    uint32_t name, ancestors; // hashes
+};
+
+struct decision_cache {
+    struct {
+        struct decision_key k;
+        char name[MAX_STR]; // the key only has its hash
+        struct decision d;
+        uint64_t stamp; // 0: unused
+    } entries[DECISION_CACHE_SIZE];
+    uint64_t clock;
+    size_t hits, misses;
+};
+
+static void decision_cache_init(struct state* st)
+{
+    st->dc = calloc(1, sizeof(*st->dc));
+    CHECK_MALLOC(st->dc);
+}
+
+static void decision_cache_deinit(struct state* st)
+{
+    free(st->dc);
+    st->dc = NULL;
+}
+
+static void decision_key(const struct state* st, const struct ruleset* rs,
+                         const struct window* w, struct decision_key* k)
+{
+    memset(k, 0, sizeof(*k));
+    k->generation = rs->generation;
+    k->n_class = w->n_class;
+    memcpy(k->class, w->class, w->n_class * sizeof(sym_t));
+    k->name_len = w->name_len;
+    k->name = hash_mem(w->name, w->name_len);
+    k->exe = w->exe;
+
+    if(rs->recursive) {
+        size_t n;
+        const Window* as = window_ancestors(st, w, &n);
+        uint32_t h = 2166136261u;
+        for(size_t i = 0; i < n; i++) {
+            const struct window* p = window_get_class(st, as[i]);
+            if(p != NULL) {
+                h ^= hash_mem((const char*)p->class,
+                              p->n_class * sizeof(sym_t));
+            }
+            h *= 16777619u;
+        }
+        k->ancestors = h;
+    }
+}
+
+static void rules_decide(const struct state* st, const struct window* w,
+                         struct decision* d)
+{
+    const struct ruleset* rs = &st->x->rules;
+    struct decision_cache* dc = st->dc;
+
+    struct decision_key k;
+    decision_key(st, rs, w, &k);
+
+    size_t lru = 0;
+    for(size_t i = 0; i < DECISION_CACHE_SIZE; i++) {
+        if(dc->entries[i].stamp != 0
+           && memcmp(&dc->entries[i].k, &k, sizeof(k)) == 0
+           && (w->name_len == 0
+               || memcmp(dc->entries[i].name, w->name, w->name_len) == 0)) {
+            dc->entries[i].stamp = ++dc->clock;
+            dc->hits += 1;
+            *d = dc->entries[i].d;
+            trace("decision cache hit: %lu", w->window);
+            return;
+        }
+
+        if(dc->entries[i].stamp < dc->entries[lru].stamp) {
+            lru = i;
+        }
+    }
+
+    dc->misses += 1;
+    rules_decide_with(st, rs, w, d);
+
+    dc->entries[lru].k = k;
+    if(w->name_len > 0) {
+        memcpy(dc->entries[lru].name, w->name, w->name_len);
+    }
+    dc->entries[lru].d = *d;
+    dc->entries[lru].stamp = ++dc->clock;
+}
+
+static char* rules_file_token(char** p)
+{
+    char* s = *p + strspn(*p, " \t\r\n");
+    if(*s == 0 || *s == '#') {
+        *p = s;
+        return NULL;
+    }
+
+    char* e;
+    if(*s == '"') {
+        e = strchr(++s, '"');
+        if(e == NULL) {
+            return NULL;
+        }
+    } else {
+        e = s + strcspn(s, " \t\r\n");
+    }
+
+    *p = *e ? e + 1 : e;
+    *e = 0;
+    return s;
+}
+
+// one rule per line, first match wins as in config.h:
+//   class|class_rec|name|exe PATTERN [layout LAYOUT] [hide_cursor]
+//   default LAYOUT
+// patterns containing spaces are double quoted, # starts a comment
+static int rules_file_load(struct symtab* syms, const char* path,
+                           struct ruleset* rs)
+{
+    FILE* f = fopen(path, "r");
+    if(f == NULL) {
+        warning("unable to open rule file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct rule* rules = NULL;
+    size_t n = 0, cap = 0, lineno = 0;
+    layout_t def = default_layout;
+    int res = 0;
+
+    char* line = NULL;
+    size_t len = 0;
+    while(res == 0 && getline(&line, &len, f) != -1) {
+        lineno += 1;
+        char* p = line;
+        char* kw = rules_file_token(&p);
+        if(kw == NULL) {
+            continue;
+        }
+
+        if(strcmp(kw, "default") == 0) {
+            const char* l = rules_file_token(&p);
+            if(l == NULL) {
+                warning("%s:%zu: default without a layout", path, lineno);
+                res = -1;
+            }
+            def = layout_intern(syms, l);
+            continue;
+        }
+
+        struct rule r = { .layout = NULL, .hide_cursor = 0 };
+        if(strcmp(kw, "class") == 0) {
+            r.match = CLASS;
+        } else if(strcmp(kw, "class_rec") == 0) {
+            r.match = CLASS_REC;
+        } else if(strcmp(kw, "name") == 0) {
+            r.match = NAME;
+        } else if(strcmp(kw, "exe") == 0) {
+            r.match = EXE;
+        } else {
+            warning("%s:%zu: unknown match: %s", path, lineno, kw);
+            res = -1;
+            continue;
+        }
+
+        const char* pattern = rules_file_token(&p);
+        if(pattern == NULL) {
+            warning("%s:%zu: %s without a pattern", path, lineno, kw);
+            res = -1;
+            continue;
+        }
+        r.pattern = layout_intern(syms, pattern);
+
+        const char* a;
+        while(res == 0 && (a = rules_file_token(&p)) != NULL) {
+            if(strcmp(a, "hide_cursor") == 0) {
+                r.hide_cursor = 1;
+            } else if(strcmp(a, "layout") == 0) {
+                const char* l = rules_file_token(&p);
+                if(l == NULL) {
+                    warning("%s:%zu: layout without a layout", path, lineno);
+                    res = -1;
+                }
+                r.layout = layout_intern(syms, l);
+            } else {
+                warning("%s:%zu: unexpected: %s", path, lineno, a);
+                res = -1;
+            }
+        }
+
+        if(res == 0 && r.layout == NULL && !r.hide_cursor) {
+            warning("%s:%zu: %s %s with neither a layout nor hide_cursor",
+                    path, lineno, kw, pattern);
+            res = -1;
+            continue;
+        }
+
+        if(n == cap) {
+            cap = MAX(2 * cap, 16);
+            rules = realloc(rules, cap * sizeof(*rules));
+            CHECK_MALLOC(rules);
+        }
+        rules[n++] = r;
+    }
+
+    free(line);
+    fclose(f);
+
+    if(res == 0) {
+        info("loaded %zu rules from %s", n, path);
+        rules_compile(syms, rs, rules, n, def);
+    }
+    free(rules);
+    return res;
+}
+
+static void rules_init(struct xhook* x)
+{
+    if(x->rules_file.path != NULL
+       && rules_file_load(x->syms, x->rules_file.path, &x->rules) == 0) {
+        return;
+    }
+
+    if(x->rules_file.path != NULL) {
+        warning("using the compiled in rules");
+    }
+    rules_compile(x->syms, &x->rules, rules, LENGTH(rules), default_layout);
+}
+
+static void rules_deinit(struct xhook* x)
+{
+    rules_free(&x->rules);
+}
+
+static void run_hooks(struct state* st, const struct window* w,
+                      const struct decision* d)
+{
+    debug("running hooks for window: %lu", w->window);
+
+    if(d->layout) {
+        set_layout(st, d->layout);
+    }
+}
+
+// hidden and shown through the root: the window asking for it may be gone
+// by the time it is shown again, and the requests go out with the rest of
+// the focus change's requests when the loop flushes
+static void cursor_apply(struct state* st)
+{
+    int hide = st->cursor.window != None || st->cursor.idle;
+    if(hide == st->cursor.hidden) {
+        return;
+    }
+
+    if(replaying(st)) {
+        debug("replay: %s cursor", hide ? "hiding" : "showing");
+    } else if(hide) {
+        st->cursor.root = st->focus_root;
+        XFixesHideCursor(st->dpy, st->cursor.root);
+    } else {
+        XFixesShowCursor(st->dpy, st->cursor.root);
+    }
+    st->cursor.hidden = hide;
+}
+
+static void cursor_set(struct state* st, const struct window* w, int hide)
+{
+    Window c = hide ? w->window : None;
+    if(c != st->cursor.window && c != None) {
+        info("hiding cursor for window %lu: %s", w->window, w->name);
+    } else if(c != st->cursor.window) {
+        info("showing cursor for window: %lu", st->cursor.window);
+    }
+
+    st->cursor.window = c;
+    cursor_apply(st);
+}
+
+static void history_add(struct state* st, Window to)
+{
+    if(st->history.predicted != None) {
+        st->history.hits += st->history.predicted == to;
+        st->history.predicted = None;
+    }
+
+    Window from = st->history.last;
+    st->history.last = to;
+    if(from == None || from == to) {
+        return;
+    }
+
+    size_t i = st->history.head;
+    st->history.head = (i + 1) % HISTORY_SIZE;
+    st->history.n = MIN(st->history.n + 1, HISTORY_SIZE);
+    st->history.ring[i].from = from;
+    st->history.ring[i].to = to;
+}
+
+// the window most often switched to from the current one, the most recent
+// one among equals, or else the one switched from: alt-tab going back
+static size_t history_predict(const struct state* st, size_t* back)
+{
+    const Window from = st->history.last;
+    size_t best = HISTORY_SIZE, best_n = 0;
+    size_t first = (st->history.head + HISTORY_SIZE
+                    - st->history.n) % HISTORY_SIZE;
+    *back = HISTORY_SIZE;
+
+    for(size_t k = 0; k < st->history.n; k++) {
+        size_t i = (st->history.head + HISTORY_SIZE - 1 - k) % HISTORY_SIZE;
+        if(st->history.ring[i].to == from && *back == HISTORY_SIZE) {
+            *back = i;
+        }
+        if(st->history.ring[i].from != from) {
+            continue;
+        }
+
+        size_t n = 0;
+        for(size_t m = 0; m < st->history.n; m++) {
+            size_t j = (first + m) % HISTORY_SIZE;
+            n += st->history.ring[j].from == from
+                && st->history.ring[j].to == st->history.ring[i].to;
+        }
+        if(n > best_n) {
+            best = i;
+            best_n = n;
+        }
+    }
+
+    return best;
+}
+
+// the first event of a burst: have the likely next window and its decision
+// cached by the time the focus settles
+static void history_prewarm(struct state* st)
+{
+    size_t back, i = history_predict(st, &back);
+    Window p = i < HISTORY_SIZE ? st->history.ring[i].to
+        : back < HISTORY_SIZE ? st->history.ring[back].from : None;
+    st->history.predicted = p;
+    if(p == None) {
+        return;
+    }
+    st->history.predictions += 1;
+
+    window_cache_epoch(st);
+    const struct window* w = window_get(st, p);
+    if(w == NULL) {
+        st->history.predicted = None;
+        return;
+    }
+
+    struct decision d;
+    rules_decide(st, w, &d);
+    debug("predicted focus: %lu (%s)", p, d.layout);
+}
+
+static void check_focus(struct state* st)
+{
+    if(st->focus.burst > 1) {
+        debug("focus settled after %u events: %zu dropped in total",
+              st->focus.burst, st->focus.dropped);
+    }
+    st->focus.burst = 0;
+
+    // when polling the change is noticed here
+    uint64_t t0 = now_ns();
+    uint64_t t_first = st->focus.t_first != 0 ? st->focus.t_first : t0;
+    st->focus.t_first = 0;
+
+    Window wx = x11_current_window(st);
+    if(wx == st->active) {
+        return;
+    }
+
+    histogram_add(&st->stats->settle, t0 - t_first);
+    st->focus.t_served = t_first;
+
+    debug("focus changed: %lu", wx);
+    st->active = wx;
+
+    window_cache_epoch(st);
+    const struct window* w = window_get(st, wx);
+    uint64_t t1 = now_ns();
+    histogram_add(&st->stats->resolve, t1 - t0);
+    if(w != NULL && window_skipped(st, w)) {
+        return;
+    }
+    status_window(st, w);
+    if(w == NULL) {
+        cursor_set(st, NULL, 0);
+        return;
+    }
+
+    struct decision d;
+    rules_decide(st, w, &d);
+    histogram_add(&st->stats->select, now_ns() - t1);
+    history_add(st, w->window);
+
+    info("focus changed %lu: %s", w->window, w->name);
+    run_hooks(st, w, &d);
+    cursor_set(st, w, d.hide_cursor);
+}
+
+static void timespec_from_ms(struct timespec* ts, unsigned int ms)
+{
+    unsigned int s = ts->tv_sec = ms / 1000;
+    ms -= s * 1000;
+    ts->tv_nsec = ms * 1000000;
+}
+
+static void timerfd_init(struct state* st)
+{
+    st->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    CHECK(st->tfd, "timerfd_create");
+}
+
+// first expiration after value_ms, then every interval_ms (0: one-shot)
+static void timerfd_set(int fd, unsigned int value_ms, unsigned int interval_ms)
+{
+    struct itimerspec its;
+    timespec_from_ms(&its.it_value, value_ms);
+    timespec_from_ms(&its.it_interval, interval_ms);
+    int r = timerfd_settime(fd, 0, &its, NULL);
+    CHECK(r, "timerfd_settime");
+}
+
+static void timerfd_arm(struct state* st,
+                        unsigned int value_ms, unsigned int interval_ms)
+{
+    timerfd_set(st->tfd, value_ms, interval_ms);
+}
+
+// the number of expirations since the last call
+static uint64_t timerfd_drain(int fd)
+{
+    uint64_t ticks = 0;
+    while(1) {
+        uint64_t t = 0;
+        ssize_t r = read(fd, &t, sizeof(t));
+        if(r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        CHECK(r, "read");
+        if(r != sizeof(t)) {
+            failwith("unexpected partial read");
+        }
+        ticks += t;
+    }
+    return ticks;
+}
+
+static void timerfd_start(struct state* st, unsigned int period_ms)
+{
+    timerfd_arm(st, period_ms, period_ms);
+}
+
+static void timerfd_stop(struct state* st)
+{
+    timerfd_arm(st, 0, 0);
+}
+
+static int timerfd_fd(const struct state* st)
+{
+    return st->tfd;
+}
+
+static void timerfd_deinit(struct state* st)
+{
+    int r = close(st->tfd); CHECK(r, "close");
+    st->tfd = -1;
+}
+
+// polling only without an EWMH compliant window manager, and not while
+// the screen is blanked: 0 when not polling
+static unsigned int focus_poll_period(const struct state* st)
+{
+    return st->ewmh || st->poll.blanked ? 0 : st->poll.period_ms;
+}
+
+static void focus_timer_restore(struct state* st)
+{
+    unsigned int p = focus_poll_period(st);
+    if(p == 0) {
+        timerfd_stop(st);
+    } else {
+        timerfd_start(st, p);
+    }
+}
+
+#if USE_XI
+static void xi_init(struct state* st)
+{
+    // device ids are the server's: forgotten when reconnecting
+    memset(&st->xi, 0, sizeof(st->xi));
+    st->xi.opcode = -1;
+    if(cursor_idle_ms == 0 && st->xkb.n == 0) {
+        return;
+    }
+
+    int opcode, event, err;
+    stats_roundtrip(st);
+    if(!XQueryExtension(st->dpy, "XInputExtension", &opcode, &event, &err)) {
+        warning("XInput extension not available");
+        return;
+    }
+
+    int major = 2, minor = 0;
+    stats_roundtrip(st);
+    if(XIQueryVersion(st->dpy, &major, &minor) != Success) {
+        warning("XInput2 not available");
+        return;
+    }
+    st->xi.opcode = opcode;
+
+    if(st->xkb.n > 0) {
+        unsigned char m[XIMaskLen(XI_HierarchyChanged)] = { 0 };
+        XISetMask(m, XI_HierarchyChanged);
+        XIEventMask em = {
+            .deviceid = XIAllDevices, .mask_len = sizeof(m), .mask = m,
+        };
+        XISelectEvents(st->dpy, st->parent, &em, 1);
+    }
+}
+
+static int xi_device_node(const struct state* st, int id, char* buf, size_t n)
+{
+    Atom t;
+    int fmt;
+    unsigned long items, after;
+    unsigned char* b = NULL;
+    stats_roundtrip(st);
+    if(XIGetProperty(st->dpy, id, st->device_node, 0, n / 4, False,
+                     AnyPropertyType, &t, &fmt, &items, &after, &b) != Success
+       || b == NULL) {
+        return -1;
+    }
+
+    int res = -1;
+    if(t == XA_STRING && fmt == 8) {
+        snprintf(buf, n, "%.*s", (int)items, (const char*)b);
+        res = 0;
+    }
+    XFree(b);
+    return res;
+}
+
+static int xi_find(const struct state* st, const char* devnode)
+{
+    int n, id = -1;
+    stats_roundtrip(st);
+    XIDeviceInfo* ds = XIQueryDevice(st->dpy, XIAllDevices, &n);
+    for(int i = 0; ds != NULL && i < n && id < 0; i++) {
+        char node[64];
+        if(ds[i].use == XISlaveKeyboard
+           && xi_device_node(st, ds[i].deviceid, LIT(node)) == 0
+           && strcmp(node, devnode) == 0) {
+            id = ds[i].deviceid;
+        }
+    }
+    if(ds != NULL) {
+        XIFreeDeviceInfo(ds);
+    }
+    return id;
+}
+
+static void xi_remember(struct state* st, sym_t serial, sym_t devnode,
+                        int id)
+{
+    size_t i = st->xi.next;
+    st->xi.next = (i + 1) % XI_DEVICES;
+    st->xi.devices[i].serial = serial;
+    st->xi.devices[i].devnode = devnode;
+    st->xi.devices[i].deviceid = id;
+}
+
+// upload the current layout's preloaded keymap to one slave keyboard
+static void xi_apply(struct state* st, int id)
+{
+    XkbDescPtr d = xkb_keymap(st, st->layout);
+
+    d->device_spec = id;
+    if(!XkbSetMap(st->dpy, XkbAllMapComponentsMask, d)) {
+        warning("XkbSetMap(%s, device %d) failed", st->layout, id);
+        return;
+    }
+    XkbSetCompatMap(st->dpy, XkbSymInterpMask | XkbGroupCompatMask, d, True);
+    XkbLockGroup(st->dpy, id, XkbGroup1Index);
+    d->device_spec = XkbUseCoreKbd;
+
+    info("applied layout %s to device %d", st->layout, id);
+    st->stats->xkb_switches += 1;
+}
+
+// returns 1 when the keyboard has been (or is going to be) given the current
+// layout by itself, 0 when it takes re-applying the layout everywhere
+static int xi_keyboard_added(struct state* st, const char* serial,
+                             const char* devnode)
+{
+    if(st->xi.opcode < 0 || st->layout == NULL
+       || xkb_keymap(st, st->layout) == NULL || serial == NULL
+       || *serial == '\0') {
+        return 0;
+    }
+
+    // the parent input device: its event device follows
+    if(devnode == NULL) {
+        return 1;
+    }
+
+    sym_t s = sym_intern(st->x->syms, STR(serial));
+    sym_t n = sym_intern(st->x->syms, STR(devnode));
+    for(size_t i = 0; i < XI_DEVICES; i++) {
+        if(st->xi.devices[i].serial == s && st->xi.devices[i].devnode == n) {
+            debug("keyboard %s: device %d (%s, cached)",
+                  serial, st->xi.devices[i].deviceid, devnode);
+            xi_apply(st, st->xi.devices[i].deviceid);
+            return 1;
+        }
+    }
+
+    int id = xi_find(st, devnode);
+    if(id >= 0) {
+        debug("keyboard %s: device %d (%s)", serial, id, devnode);
+        xi_remember(st, s, n, id);
+        xi_apply(st, id);
+        return 1;
+    }
+
+    debug("keyboard %s (%s) not yet added by the server", serial, devnode);
+    size_t i = st->xi.n_pending < XI_PENDING
+        ? st->xi.n_pending++ : XI_PENDING - 1;
+    st->xi.pending[i].serial = s;
+    snprintf(LIT(st->xi.pending[i].devnode), "%s", devnode);
+    return 1;
+}
+
+static void xi_hierarchy_changed(struct state* st, const XIHierarchyEvent* e)
+{
+    for(int i = 0; i < e->num_info; i++) {
+        const XIHierarchyInfo* h = &e->info[i];
+        if(h->flags & XISlaveRemoved) {
+            for(size_t j = 0; j < XI_DEVICES; j++) {
+                if(st->xi.devices[j].deviceid == h->deviceid) {
+                    debug("device %d removed", h->deviceid);
+                    st->xi.devices[j].serial = SYM_NONE;
+                    st->xi.devices[j].devnode = SYM_NONE;
+                    st->xi.devices[j].deviceid = -1;
+                }
+            }
+        }
+
+        if(!(h->flags & (XISlaveAdded | XIDeviceEnabled))
+           || h->use != XISlaveKeyboard || st->xi.n_pending == 0) {
+            continue;
+        }
+
+        char node[64];
+        if(xi_device_node(st, h->deviceid, LIT(node)) != 0) {
+            continue;
+        }
+
+        for(size_t j = 0; j < st->xi.n_pending; j++) {
+            if(strcmp(st->xi.pending[j].devnode, node) != 0) {
+                continue;
+            }
+
+            xi_remember(st, st->xi.pending[j].serial,
+                        sym_intern(st->x->syms, STR(node)), h->deviceid);
+            if(st->layout != NULL && xkb_keymap(st, st->layout) != NULL) {
+                xi_apply(st, h->deviceid);
+            }
+            st->xi.pending[j] = st->xi.pending[--st->xi.n_pending];
+            break;
+        }
+    }
+}
+
+#else
+static void xi_init(struct state* st)
+{
+}
+
+static int xi_keyboard_added(struct state* st, const char* serial,
+                             const char* devnode)
+{
+    return 0;
+}
+#endif
+
+static void udev_init(struct xhook* x)
+{
+    x->udev = udev_new();
+    if(x->udev == NULL) {
+        failwith("udev_new");
+    }
+
+    x->udev_mon = udev_monitor_new_from_netlink(x->udev, "udev");
+    if(x->udev_mon == NULL) {
+        failwith("udev_monitor_new_from_netlink");
+    }
+
+    int r = udev_monitor_filter_add_match_subsystem_devtype(
+        x->udev_mon, "input", NULL);
+    if(r < 0) {
+        failwith("udev_monitor_filter_add_match_subsystem_devtype");
+    }
+
+    r = udev_monitor_filter_update(x->udev_mon);
+    if(r < 0) {
+        failwith("udev_monitor_filter_update");
+    }
+}
+
+static void udev_deinit(struct xhook* x)
+{
+    udev_monitor_unref(x->udev_mon);
+    udev_unref(x->udev);
+}
+
+static void udev_start(struct xhook* x)
+{
+    int r = udev_monitor_enable_receiving(x->udev_mon);
+    if(r < 0) {
+        failwith("udev_monitor_enable_receiving");
+    }
+
+    set_blocking(udev_monitor_get_fd(x->udev_mon), 0);
+}
+
+static int udev_fd(const struct xhook* x)
+{
+    int fd = udev_monitor_get_fd(x->udev_mon);
+    if(fd < 0) {
+        failwith("udev_monitor_get_fd");
+    }
+    return fd;
+}
+
+// apply the layout again, for keyboards that came up with the default one
+static void relayout(struct state* st)
+{
+    if(st->relayout == 0) {
+        return;
+    }
+
+    info("re-applying layout after %u keyboard(s) were added",
+         st->relayout);
+    st->relayout = 0;
+
+    const layout_t l = st->layout;
+    reset_layout(st);
+    st->focus.t_served = 0;
+
+    window_cache_epoch(st);
+    const struct window* w = window_get(st, st->active);
+    if(w != NULL && window_skipped(st, w)) {
+        // a dialog's decision is not to be applied: keep its owner's
+        if(l != NULL) {
+            set_layout(st, l);
+        }
+    } else if(w != NULL) {
+        struct decision d;
+        rules_decide(st, w, &d);
+        run_hooks(st, w, &d);
+    }
+}
+
+static void focus_settled(struct state* st)
+{
+    check_focus(st);
+    if(st->relayout > 0) {
+        task_defer(st, relayout);
+    }
+}
+
+struct keyboard {
+    const char* seat;
+    const char* serial;
+    const char* devnode; // NULL for the parent input device
+};
+
+// returns 1 for added keyboards, 0 for other events
+static int udev_keyboard_added(struct udev_device* d, struct keyboard* k)
+{
+    const char* action = udev_device_get_property_value(d, "ACTION");
+    if(action == NULL) {
+        debug("udev: event with action == NULL");
+        return 0;
+    } else if(strcmp(action, "add") != 0) {
+        debug("udev; ignoring non-add event: %s", action);
+        return 0;
+    }
+
+    const char* kbd = udev_device_get_property_value(d, "ID_INPUT_KEYBOARD");
+    if(kbd == NULL) {
+        debug("udev; ignoring non keyboard event (empty)");
+        return 0;
+    } else if(strcmp(kbd, "1") != 0) {
+        debug("udev; ignoring non keyboard event (ID_INPUT_KEYBOARD=%s)", kbd);
+        return 0;
+    }
 
-struct state {
-    int running;
-    Window active;
+    // devices without an explicit seat belong to the default one
+    k->seat = udev_device_get_property_value(d, "ID_SEAT");
+    if(k->seat == NULL) {
+        k->seat = "seat0";
+    }
 
-    Window cursor_hidden_for_window;
+    k->serial = udev_device_get_property_value(d, "ID_SERIAL");
+    k->devnode = udev_device_get_devnode(d);
+    info("keyboard added: %s (%s)", k->serial, k->seat);
+    return 1;
+}
 
-    layout_t layout;
+// hubs and KVM switches add keyboards in bursts: re-apply once the burst
+// has settled
+static void keyboards_added(struct state* st, uint32_t n)
+{
+    rec_write(st, REC_UDEV, &n, sizeof(n));
+    st->relayout += n;
+    if(st->lost) {
+        return; // the reconnect timer stays, and applies the layout anew
+    } else if(focus_settle_ms == 0) {
+        task_defer(st, relayout);
+    } else {
+        timerfd_arm(st, focus_settle_ms, focus_poll_period(st));
+    }
+}
 
-    int sfd, tfd;
+static void udev_handle_event(struct xhook* x)
+{
+    unsigned int added[x->n];
+    memset(added, 0, sizeof(added));
 
-    Display* dpy;
-    int scr;
-    Window parent;
+    while(1) {
+        errno = 0;
+        struct udev_device* d = udev_monitor_receive_device(x->udev_mon);
+        if(d == NULL) {
+            if(errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                warning("udev_monitor_receive_device: %s", strerror(errno));
+            }
+            break;
+        }
 
-    Atom net_wm_name, wm_name, utf8_string, string, compound_text, wm_class;
+        struct keyboard k;
+        int kbd = udev_keyboard_added(d, &k);
+        for(size_t i = 0; kbd && i < x->n; i++) {
+            struct state* st = &x->displays[i];
+            if(strcmp(st->seat, k.seat) == 0
+               && (st->lost || !xi_keyboard_added(st, k.serial, k.devnode))) {
+                added[i] += 1;
+            }
+        }
+        udev_device_unref(d);
+    }
 
-    struct udev* udev;
-    struct udev_monitor* udev_mon;
-};
+    for(size_t i = 0; i < x->n; i++) {
+        if(added[i] > 0) {
+            keyboards_added(&x->displays[i], added[i]);
+        }
+    }
+}
 
-static void x11_init(struct state* st)
+static void rules_watch_init(struct xhook* x)
 {
-    XSetErrorHandler(handle_x11_error);
-
-    st->dpy = XOpenDisplay(NULL);
-    if(st->dpy == NULL) failwith("unable to open display");
+    x->rules_file.fd = -1;
+    if(x->rules_file.path == NULL) {
+        return;
+    }
 
-    st->scr = DefaultScreen(st->dpy);
-    st->parent = RootWindow(st->dpy, st->scr);
+    // editors replace files rather than write them: watch the directory
+    x->rules_file.dir = strdup(x->rules_file.path);
+    CHECK_MALLOC(x->rules_file.dir);
+    char* s = strrchr(x->rules_file.dir, '/');
+    if(s == NULL) {
+        free(x->rules_file.dir);
+        x->rules_file.dir = strdup(".");
+        CHECK_MALLOC(x->rules_file.dir);
+        x->rules_file.base = x->rules_file.path;
+    } else {
+        *s = 0;
+        x->rules_file.base = s + 1;
+    }
 
-    info("tracking focus changes of %lu and its children", st->parent);
-    XSelectInput(st->dpy, st->parent, FocusChangeMask);
+    int fd = x->rules_file.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    CHECK(fd, "inotify_init1");
 
-    st->net_wm_name = XInternAtom(st->dpy, "_NET_WM_NAME", False);
-    st->wm_name = XInternAtom(st->dpy, "WM_NAME", False);
-    st->utf8_string = XInternAtom(st->dpy, "UTF8_STRING", False);
-    st->string = XInternAtom(st->dpy, "STRING", False);
-    st->compound_text = XInternAtom(st->dpy, "COMPOUND_TEXT", False);
-    st->wm_class = XInternAtom(st->dpy, "WM_CLASS", False);
+    int r = inotify_add_watch(fd, x->rules_file.dir,
+                              IN_CLOSE_WRITE | IN_MOVED_TO);
+    CHECK(r, "inotify_add_watch(%s)", x->rules_file.dir);
 
-    XSync(st->dpy, False);
+    info("watching rule file: %s", x->rules_file.path);
 }
 
-static void x11_deinit(struct state* st)
+static void rules_watch_deinit(struct xhook* x)
 {
-    XSync(st->dpy, True);
-    XCloseDisplay(st->dpy);
+    if(x->rules_file.fd >= 0) {
+        int r = close(x->rules_file.fd); CHECK(r, "close");
+        x->rules_file.fd = -1;
+    }
+    free(x->rules_file.dir);
+    x->rules_file.dir = NULL;
 }
 
-static int x11_fd(const struct state* st)
+// -1 without a rule file: ignored by poll
+static int rules_watch_fd(const struct xhook* x)
 {
-    return XConnectionNumber(st->dpy);
+    return x->rules_file.fd;
 }
 
-#define MAX_STR 1024
-#define MAX_CLASS 10
-
-struct window
+// the new rules take over at once, every window stays cached: only the
+// active windows whose decision changed are acted upon
+static void rules_reload(struct xhook* x)
 {
-    Window window;
-    char name[MAX_STR];
-    char class[MAX_CLASS][MAX_STR];
-    size_t n_class;
-    Window parent, root;
-};
+    struct ruleset rs;
+    if(rules_file_load(x->syms, x->rules_file.path, &rs) != 0) {
+        warning("keeping the current rules");
+        return;
+    }
 
-static int x11_window_name(const struct state* st, Window w, char* buf)
-{
-    Atom t = None;
-    int fmt;
-    unsigned long nitems, remaining;
-    unsigned char* b = NULL;
+    struct ruleset old = x->rules;
+    x->rules = rs;
 
-    Atom p = st->net_wm_name, T = st->utf8_string;
+    for(size_t i = 0; i < x->n; i++) {
+        struct state* st = &x->displays[i];
+        if(st->lost) {
+            continue;
+        }
 
-attempt:
-    debug("XGetWindowProperty(%lu, %s)", w, XGetAtomName(st->dpy, p));
-    int res = XGetWindowProperty(st->dpy, w, p,
-                                 0L, MAX_STR-1,
-                                 False /* delete */,
-                                 T /* req_type */,
-                                 &t /* actual_type */,
-                                 &fmt, &nitems, &remaining, &b);
+        if(rs.exe && !old.exe) {
+            // resolved without their executables
+            window_cache_deinit(st);
+            window_cache_init(st);
+        }
 
-    if(res != Success) {
-        debug("XGetWindowProperty(%lu, %s) failed",
-              w, XGetAtomName(st->dpy, p));
-        return -1;
-    }
+        window_cache_epoch(st);
+        const struct window* w = window_get(st, st->active);
+        if(w == NULL || window_skipped(st, w)) {
+            continue;
+        }
 
-    if(t == None) {
-        if(p == st->net_wm_name) {
-            p = st->wm_name;
-            T = st->string;
-            goto attempt;
+        struct decision b, d;
+        rules_decide_with(st, &old, w, &b);
+        rules_decide_with(st, &x->rules, w, &d);
+
+        if(b.layout != d.layout) {
+            info("new rules for %lu: %s -> %s", w->window, b.layout, d.layout);
+            st->focus.t_served = 0;
+            run_hooks(st, w, &d);
         }
 
-        debug("window %lu has no name", w);
-        buf[0] = 0;
-        return 0;
+        if(b.hide_cursor != d.hide_cursor) {
+            cursor_set(st, w, d.hide_cursor);
+        }
     }
 
-    if(t == st->compound_text) {
-        warning("window %lu has COMPOUND_TEXT name: ignoring", w);
-        buf[0] = 0;
-        return 0;
+    rules_free(&old);
+}
+
+static void rules_watch_handle_event(struct xhook* x)
+{
+    int changed = 0;
+    while(1) {
+        char buf[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n = read(x->rules_file.fd, buf, sizeof(buf));
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        CHECK(n, "read");
+
+        for(char* p = buf; p < buf + n;) {
+            const struct inotify_event* e = (const struct inotify_event*)p;
+            if(e->len > 0 && strcmp(e->name, x->rules_file.base) == 0) {
+                changed = 1;
+            }
+            p += sizeof(*e) + e->len;
+        }
     }
 
-    if(t != st->utf8_string && t != st->string) {
-        failwith("XGetWindowProperty(%lu, %s) returned an unexpected type: %s",
-                 w, XGetAtomName(st->dpy, p),
-                 XGetAtomName(st->dpy, t));
+    if(changed) {
+        debug("rule file changed: %s", x->rules_file.path);
+        rules_reload(x);
     }
+}
 
-    if(fmt != 8) {
-        failwith("XGetWindowProperty(%lu, %s) returned an unexpected format",
-                 w, XGetAtomName(st->dpy, p));
+static void stats_dump_histogram(const char* key, const struct histogram* h)
+{
+    if(h->count == 0) {
+        info("stats: %s count=0", key);
+        return;
     }
 
-    memcpy(buf, b, nitems+1);
-    XFree(b);
-    return 0;
+    info("stats: %s count=%" PRIu64 " mean=%" PRIu64 "us p50=%" PRIu64 "us"
+         " p90=%" PRIu64 "us p99=%" PRIu64 "us max=%" PRIu64 "us",
+         key, h->count, h->sum_us / h->count,
+         histogram_quantile(h, 0.50), histogram_quantile(h, 0.90),
+         histogram_quantile(h, 0.99), h->max_us);
 }
 
-static size_t x11_window_class(const struct state* st, Window w,
-                               char cls[MAX_CLASS][MAX_STR],
-                               size_t* n_cls)
+// key=value lines meant to be grepped out of the log
+static void stats_dump(const struct state* st)
 {
-    Atom t = None;
-    int fmt;
-    unsigned long nitems, remaining;
-    unsigned char* b = NULL;
-    int res = XGetWindowProperty(st->dpy, w, st->wm_class,
-                                 0L, MAX_CLASS*MAX_STR,
-                                 False /* delete */,
-                                 XA_STRING /* req_type */,
-                                 &t /* actual_type */,
-                                 &fmt, &nitems, &remaining, &b);
+    const struct stats* s = st->stats;
+    info("stats: display name=%s seat=%s",
+         st->dpy != NULL ? XDisplayString(st->dpy) : "(replay)", st->seat);
+    info("stats: uptime=%" PRIu64 "ms startup=%" PRIu64 "us"
+         " roundtrips=%" PRIu64 " spawns=%" PRIu64 " xkb_switches=%" PRIu64
+         " reconnects=%" PRIu64, (now_ns() - s->start) / 1000000,
+         (s->ready - s->start) / 1000, s->roundtrips, s->spawns,
+         s->xkb_switches, s->reconnects);
+    info("stats: x11_errors suppressed=%zu reported=%zu",
+         st->errors->suppressed, st->errors->reported);
+    info("stats: focus events=%zu dropped=%zu",
+         st->focus.events, st->focus.dropped);
 
-    if(res != Success) {
-        debug("XGetWindowProperty(%lu, %s) failed",
-              w, XGetAtomName(st->dpy, st->wm_class));
-        return -1;
+    const struct window_cache* wc = st->wc;
+    info("stats: window_cache hits=%zu misses=%zu evictions=%zu "
+         "invalidations=%zu",
+         wc->hits, wc->misses, wc->evictions, wc->invalidations);
+    info("stats: names in_use=%zu chunks=%zu bytes=%zu",
+         st->names->in_use, st->names->chunks, st->names->arena.allocated);
+    info("stats: decision_cache hits=%zu misses=%zu",
+         st->dc->hits, st->dc->misses);
+    info("stats: pid_cache hits=%zu misses=%zu",
+         st->pc->hits, st->pc->misses);
+    info("stats: history transitions=%zu predictions=%zu hits=%zu",
+         st->history.n, st->history.predictions, st->history.hits);
+    info("stats: symbols interned=%zu bytes=%zu",
+         st->x->syms->n - 1, st->x->syms->arena.allocated);
+
+    stats_dump_histogram("settle", &s->settle);
+    stats_dump_histogram("resolve", &s->resolve);
+    stats_dump_histogram("select", &s->select);
+    stats_dump_histogram("hook", &s->hook);
+    stats_dump_histogram("focus_to_hook", &s->focus_to_hook);
+}
+
+static int signalfd_init(struct xhook* x)
+{
+    sigset_t m;
+    sigemptyset(&m);
+    sigaddset(&m, SIGINT);
+    sigaddset(&m, SIGTERM);
+    sigaddset(&m, SIGCHLD);
+    sigaddset(&m, SIGUSR1);
+
+    int fd = x->sfd = signalfd(-1, &m, SFD_CLOEXEC);
+    CHECK(fd, "signalfd");
+
+    int r = sigprocmask(SIG_BLOCK, &m, NULL);
+    CHECK(r, "sigprocmask");
+
+    set_blocking(fd, 0);
+
+    return fd;
+}
+
+static int signalfd_fd(const struct xhook* x)
+{
+    return x->sfd;
+}
+
+static void signalfd_deinit(struct xhook* x)
+{
+    int r = close(x->sfd); CHECK(r, "close");
+    x->sfd = -1;
+}
+
+static void signalfd_handle_event(struct xhook* x)
+{
+    while(1) {
+        struct signalfd_siginfo si;
+
+        ssize_t s = read(x->sfd, &si, sizeof(si));
+        if(s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        CHECK(s, "read");
+
+        if(s != sizeof(si)) {
+            failwith("unexpected partial read");
+        }
+
+        if(si.ssi_signo == SIGINT) {
+            debug("SIGINT");
+            x->running = 0;
+        } else if(si.ssi_signo == SIGTERM) {
+            debug("SIGTERM");
+            x->running = 0;
+        } else if(si.ssi_signo == SIGCHLD) {
+            trace("SIGCHLD");
+            hook_reap(x);
+        } else if(si.ssi_signo == SIGUSR1) {
+            debug("SIGUSR1");
+            for(size_t i = 0; i < x->n; i++) {
+                stats_dump(&x->displays[i]);
+            }
+        } else {
+            warning("unhandled signal: %u", si.ssi_signo);
+        }
     }
+}
 
-    if(t == None) {
-        trace("window %lu has no class", w);
-        *n_cls = 0;
-        return 0;
+#if USE_XSS
+// milliseconds since the last input, as the screen saver sees it
+static unsigned long xss_idle_ms(const struct state* st)
+{
+    XScreenSaverInfo i;
+    stats_roundtrip(st);
+    if(st->xss_event < 0 || !XScreenSaverQueryInfo(st->dpy, st->parent, &i)) {
+        return ULONG_MAX;
     }
+    return i.idle;
+}
 
-    if(t != XA_STRING) {
-        failwith("XGetWindowProperty(%lu, %s) returned an unexpected type",
-                 w, XGetAtomName(st->dpy, st->wm_class));
+static void xss_notify(struct state* st, const XScreenSaverNotifyEvent* e)
+{
+    int blanked = e->state == ScreenSaverOn;
+    if(blanked == st->poll.blanked) {
+        return;
     }
 
-    if(fmt != 8) {
-        failwith("XGetWindowProperty(%lu, %s) returned an unexpected format",
-                 w, XGetAtomName(st->dpy, st->wm_class));
+    st->poll.blanked = blanked;
+    if(st->ewmh) {
+        return;
     }
 
-    char* p = (char*)b;
-    char* P = p + nitems;
-    size_t i = 0;
-    while(p < P) {
-        size_t l = strlen(p);
-        size_t L = MIN(MAX_STR-1, l);
-        memcpy(cls[i++], p, L + 1);
-        p += l + 1;
+    if(blanked) {
+        info("screen saver on: not polling");
+    } else {
+        info("screen saver off: polling again");
+        st->poll.period_ms = poll_min_ms;
     }
+    focus_timer_restore(st);
+}
+#endif
 
-    *n_cls = i;
+// after each poll: back to the shortest period when something happened,
+// otherwise twice as long as the last one
+static void poll_adapt(struct state* st, int active)
+{
+    if(focus_poll_period(st) == 0) {
+        return;
+    }
 
-    XFree(b);
-    return 0;
+    unsigned int p = st->poll.period_ms;
+#if USE_XSS
+    active = active || xss_idle_ms(st) < p;
+#endif
+    st->poll.period_ms = active ? poll_min_ms : MIN(2 * p, poll_max_ms);
+    if(st->poll.period_ms != p) {
+        trace("polling every %ums", st->poll.period_ms);
+        focus_timer_restore(st);
+    }
 }
 
-static int x11_window_parent(const struct state* st, Window w,
-                             Window* root, Window* parent)
-{
-    Window r, p;
-    Window *children = NULL;
-    unsigned int children_n;
-    Status res = XQueryTree(st->dpy, w,
-                            root != NULL ? root : &r,
-                            parent != NULL ? parent : &p,
-                            &children, &children_n);
+static void display_reconnect(struct state* st);
 
-    if(!res) {
-        debug("XQueryTree(%lu) failed", w);
-        return -1;
+static void timerfd_ticks(struct state* st)
+{
+    uint64_t ticks = timerfd_drain(st->tfd);
+    if(ticks == 0) {
+        failwith("spurious timerfd read");
+    } else if(ticks > 1) {
+        warning("missed timer ticks: %" PRIu64, ticks - 1);
     }
 
-    XFree(children);
+    trace("tick");
+    if(st->lost) {
+        display_reconnect(st);
+        return;
+    }
 
-    return 0;
+    rec_event(st, REC_TICK);
+    Window active = st->active;
+    focus_settled(st);
+    poll_adapt(st, st->active != active);
 }
 
-static int x11_window(const struct state* st, Window wx, struct window* w)
+#if USE_XI
+static void cursor_idle_select(struct state* st)
 {
-    w->window = wx;
-
-    if(x11_window_name(st, wx, w->name) != 0) {
-        return -1;
-    }
-    if(w->name[0]) {
-        debug("window %lu name: %s", wx, w->name);
+    unsigned char m[XIMaskLen(XI_RawMotion)] = { 0 };
+    XISetMask(m, XI_RawMotion);
+    XIEventMask em = {
+        .deviceid = XIAllMasterDevices, .mask_len = sizeof(m), .mask = m,
+    };
+    for(int i = 0; i < st->n_roots; i++) {
+        XISelectEvents(st->dpy, st->roots[i], &em, 1);
     }
+}
 
-    if(x11_window_class(st, wx, w->class, &w->n_class) != 0) {
-        return -1;
-    }
-    for(size_t i = 0; i < w->n_class; i++) {
-        debug("window %lu class: %s", wx, w->class[i]);
+// unclutter: hide the cursor after cursor_idle_ms without pointer motion,
+// as reported by XInput2 raw motion events on the roots
+static void cursor_idle_init(struct state* st)
+{
+    st->cursor.tfd = -1;
+    if(cursor_idle_ms == 0) {
+        return;
     }
 
-    if(x11_window_parent(st, wx, &w->root, &w->parent) != 0) {
-        return -1;
+    if(st->xi.opcode < 0) {
+        warning("XInput2 not available: not hiding idle cursor");
+        return;
     }
-    debug("window %lu root: %lu", wx, w->root);
-    debug("window %lu parent: %lu", wx, w->parent);
+    cursor_idle_select(st);
 
-    return 0;
+    st->cursor.tfd = timerfd_create(CLOCK_MONOTONIC,
+                                    TFD_NONBLOCK | TFD_CLOEXEC);
+    CHECK(st->cursor.tfd, "timerfd_create");
+
+    st->cursor.motion = now_ns();
+    timerfd_set(st->cursor.tfd, cursor_idle_ms, 0);
+    info("hiding the cursor after %ums without motion", cursor_idle_ms);
 }
 
-static int window_has_class(const struct window* w, const char* cls)
+static void cursor_idle_deinit(struct state* st)
 {
-    for(size_t i = 0; i < w->n_class; i++) {
-        if(strcmp(w->class[i], cls) == 0) {
-            return 1;
-        }
+    if(st->cursor.tfd >= 0) {
+        int r = close(st->cursor.tfd); CHECK(r, "close");
+        st->cursor.tfd = -1;
     }
+}
 
-    return 0;
+static int cursor_idle_fd(const struct state* st)
+{
+    return st->cursor.tfd;
 }
 
-static int window_has_class_rec(const struct state* st,
-                                const struct window* w, const char* cls)
+// called for every motion: only the idle transitions touch the timer
+static void cursor_motion(struct state* st)
 {
-    if(window_has_class(w, cls)) {
-        return 1;
+    st->cursor.motion = now_ns();
+    if(st->cursor.idle) {
+        st->cursor.idle = 0;
+        cursor_apply(st);
+        timerfd_set(st->cursor.tfd, cursor_idle_ms, 0);
     }
+}
 
-    Window xw = w->parent;
-    struct window p;
-    do {
-        if(x11_window(st, xw, &p) != 0) {
-            warning("x11_window(%lu) failed", xw);
-            return 0;
-        }
+static void cursor_idle_tick(struct state* st)
+{
+    timerfd_drain(st->cursor.tfd);
 
-        if(window_has_class(&p, cls)) {
-            return 1;
-        }
+    uint64_t idle = (now_ns() - st->cursor.motion) / 1000000;
+    if(idle < cursor_idle_ms) {
+        timerfd_set(st->cursor.tfd, cursor_idle_ms - idle, 0);
+        return;
+    }
+
+    debug("cursor idle for %" PRIu64 "ms", idle);
+    st->cursor.idle = 1;
+    cursor_apply(st);
+}
+#else
+static void cursor_idle_select(struct state* st)
+{
+}
 
-        xw = p.parent;
-    } while(xw != p.root);
+static void cursor_idle_init(struct state* st)
+{
+    if(cursor_idle_ms > 0) {
+        warning("cursor_idle_ms set without XInput2 support (XI=1)");
+    }
+}
 
-    return 0;
+static void cursor_idle_deinit(struct state* st)
+{
 }
 
-static int window_has_name(const struct window* w, const char* name)
+static int cursor_idle_fd(const struct state* st)
 {
-    return strcmp(w->name, name) == 0;
+    return -1;
 }
 
-static Window x11_current_window(const struct state* st)
+static void cursor_idle_tick(struct state* st)
 {
-    Window w;
-    int rt;
-    if(XGetInputFocus(st->dpy, &w, &rt) != 1) {
-        failwith("XGetInputFocus failed");
-    }
-    trace("focused window: %lu (%lx)", w, w);
-    return w;
 }
+#endif
 
-static void set_layout(struct state* st, const layout_t l)
+static void focus_mode_update(struct state* st)
 {
-    if(st->layout == l) {
+    int ewmh = st->opts.poll ? 0 : x11_ewmh_check(st);
+    if(ewmh == st->ewmh) {
         return;
     }
 
-    char cmd[255];
-    snprintf(LIT(cmd), "keymap %s", l);
+    st->ewmh = ewmh;
+    if(ewmh) {
+        info("EWMH compliant window manager: tracking _NET_ACTIVE_WINDOW");
+    } else {
+        info("no EWMH compliant window manager: polling every %u-%ums",
+             poll_min_ms, poll_max_ms);
+    }
+    st->poll.period_ms = poll_min_ms;
+    focus_timer_restore(st);
+}
+
+// the focus is about to change: wait for it to settle before resolving
+static void focus_changed(struct state* st)
+{
+    rec_event(st, REC_FOCUS);
+    st->focus.events += 1;
+    if(focus_settle_ms == 0) {
+        check_focus(st);
+        return;
+    }
 
-    debug("running: %s", cmd);
-    int ec = system(cmd);
-    CHECK(ec, "system(%s)", cmd);
+    if(st->focus.burst > 0) {
+        st->focus.dropped += 1;
+    } else {
+        st->focus.t_first = now_ns();
+        history_prewarm(st);
+    }
+    st->focus.burst += 1;
 
-    if(ec != 0) {
-        warning("changing to layout %s failed with exit code: %d", cmd, ec);
+    if(st->focus.burst > focus_settle_max) {
+        debug("focus burst of %u events: not waiting any longer",
+              st->focus.burst);
+        focus_timer_restore(st);
+        focus_settled(st);
         return;
     }
 
-    info("switched layout: %s", cmd);
-    st->layout = l;
+    timerfd_arm(st, focus_settle_ms, focus_poll_period(st));
 }
 
-#include "config.h"
+// a check not prompted by a focus event: after the window manager changed
+// or the display came back
+static void focus_recheck(struct state* st)
+{
+    rec_event(st, REC_CHECK);
+    check_focus(st);
+}
 
-static void run_hooks(struct state* st, const struct window* w)
+// the focused window at startup: its hooks are run whatever was applied
+// before
+static void focus_initial(struct state* st)
 {
-    debug("running hooks for window: %lu", w->window);
+    rec_event(st, REC_START);
+    st->active = x11_current_window(st);
 
-    layout_t l = select_layout(st, w);
-    if(l) {
-        set_layout(st, l);
+    window_cache_epoch(st);
+    const struct window* w = window_get(st, st->active);
+    if(w != NULL && window_skipped(st, w)) {
+        w = NULL;
+    }
+    status_window(st, w);
+    if(w != NULL) {
+        struct decision d;
+        rules_decide(st, w, &d);
+        run_hooks(st, w, &d);
     }
 }
 
-static void check_focus(struct state* st)
+static void x11_handle_event(struct state* st)
 {
-    Window wx = x11_current_window(st);
-    if(wx == st->active) {
-        return;
+    while(XPending(st->dpy)) {
+        XEvent ev;
+        int r = XNextEvent(st->dpy, &ev);
+        CHECK_IF(r != Success, "XNextEvent");
+
+        if(ev.type == FocusIn) {
+            trace("focus in event: %lu", ev.xfocus.window);
+        } else if(ev.type == FocusOut) {
+            focus_changed(st);
+        } else if(ev.type == PropertyNotify
+                  && x11_is_root(st, ev.xproperty.window)) {
+            const XPropertyEvent* p = &ev.xproperty;
+            if(p->atom == st->net_active_window) {
+                trace("_NET_ACTIVE_WINDOW changed on %lu", p->window);
+                st->focus_root = p->window;
+                if(st->ewmh) {
+                    focus_changed(st);
+                }
+            } else if(p->window == st->parent
+                      && (p->atom == st->net_supporting_wm_check
+                          || p->atom == st->net_supported)) {
+                debug("window manager changed: re-checking EWMH compliance");
+                focus_mode_update(st);
+                focus_recheck(st);
+            }
+#if USE_XI
+        } else if(ev.type == GenericEvent
+                  && ev.xcookie.extension == st->xi.opcode
+                  && XGetEventData(st->dpy, &ev.xcookie)) {
+            if(ev.xcookie.evtype == XI_RawMotion) {
+                cursor_motion(st);
+            } else if(ev.xcookie.evtype == XI_HierarchyChanged) {
+                xi_hierarchy_changed(st, ev.xcookie.data);
+            }
+            XFreeEventData(st->dpy, &ev.xcookie);
+#endif
+#if USE_XSS
+        } else if(st->xss_event >= 0
+                  && ev.type == st->xss_event + ScreenSaverNotify) {
+            xss_notify(st, (const XScreenSaverNotifyEvent*)&ev);
+#endif
+#if USE_RANDR
+        } else if(st->randr_event >= 0
+                  && (ev.type == st->randr_event + RRScreenChangeNotify
+                      || ev.type == st->randr_event + RRNotify)) {
+            XRRUpdateConfiguration(&ev);
+            debug("RandR configuration changed");
+            // outputs coming and going move windows and the focus with them
+            focus_changed(st);
+#endif
+        } else if(window_cache_handle_event(st, &ev)) {
+            trace("window cache event: type=%d", ev.type);
+        } else {
+            warning("ignored event: type=%d", ev.type);
+        }
     }
+}
 
-    debug("focus changed: %lu", wx);
-    st->active = wx;
+// descriptors are serviced in priority order: signals and the focus path
+// first, the rest while within the iteration's budget
+enum priority {
+    PRIO_SIGNAL = 0,
+    PRIO_FOCUS,
+    PRIO_SETTLE,
+    PRIO_BACKGROUND,
+};
 
-    if(st->cursor_hidden_for_window != wx) {
-        info("showing cursor for window: %lu", st->cursor_hidden_for_window);
-        XFixesShowCursor(st->dpy, st->cursor_hidden_for_window);
-        st->cursor_hidden_for_window = None;
-    }
+#define LOOP_BUDGET_MS 5
 
-    struct window w;
-    if(x11_window(st, wx, &w) != 0) {
+struct source {
+    enum priority prio;
+    int fd;
+    struct state* st; // NULL for the shared sources
+    void (*shared)(struct xhook* x);
+    void (*display)(struct state* st);
+};
+
+static void loop_add(struct xhook* x, enum priority prio, int fd,
+                     struct state* st, void (*shared)(struct xhook*),
+                     void (*display)(struct state*))
+{
+    if(fd < 0) {
         return;
     }
 
-    info("focus changed %lu: %s", w.window, w.name);
-    run_hooks(st, &w);
+    struct source* s = &x->sources[x->n_sources++];
+    *s = (struct source) {
+        .prio = prio, .fd = fd, .st = st,
+        .shared = shared, .display = display,
+    };
 
-    if(hide_cursor(st, &w)) {
-        info("hiding cursor for window %lu: %s", w.window, w.name);
-        XFixesHideCursor(st->dpy, w.window);
-        st->cursor_hidden_for_window = w.window;
-    }
+    struct epoll_event e = { .events = EPOLLIN, .data.ptr = s };
+    int r = epoll_ctl(x->epfd, EPOLL_CTL_ADD, fd, &e);
+    CHECK(r, "epoll_ctl(%d)", fd);
 }
 
-static void udev_init(struct state* st)
+// point st's source served by display at another descriptor (-1: none)
+static void loop_replace(struct xhook* x, struct state* st,
+                         void (*display)(struct state*), int fd)
 {
-    st->udev = udev_new();
-    if(st->udev == NULL) {
-        failwith("udev_new");
-    }
-
-    st->udev_mon = udev_monitor_new_from_netlink(st->udev, "udev");
-    if(st->udev_mon == NULL) {
-        failwith("udev_monitor_new_from_netlink");
-    }
+    for(size_t i = 0; i < x->n_sources; i++) {
+        struct source* s = &x->sources[i];
+        if(s->st != st || s->display != display) {
+            continue;
+        }
 
-    int r = udev_monitor_filter_add_match_subsystem_devtype(
-        st->udev_mon, "input", NULL);
-    if(r < 0) {
-        failwith("udev_monitor_filter_add_match_subsystem_devtype");
-    }
+        if(s->fd >= 0) {
+            int r = epoll_ctl(x->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+            CHECK(r, "epoll_ctl(%d)", s->fd);
+        }
 
-    r = udev_monitor_filter_update(st->udev_mon);
-    if(r < 0) {
-        failwith("udev_monitor_filter_update");
+        s->fd = fd;
+        if(fd >= 0) {
+            struct epoll_event e = { .events = EPOLLIN, .data.ptr = s };
+            int r = epoll_ctl(x->epfd, EPOLL_CTL_ADD, fd, &e);
+            CHECK(r, "epoll_ctl(%d)", fd);
+        }
+        return;
     }
 }
 
-static void udev_deinit(struct state* st)
+static enum priority source_prio(const struct epoll_event* e)
 {
-    udev_monitor_unref(st->udev_mon);
-    udev_unref(st->udev);
+    return ((const struct source*)e->data.ptr)->prio;
 }
 
-static void udev_start(struct state* st)
+static void loop_init(struct xhook* x)
 {
-    int r = udev_monitor_enable_receiving(st->udev_mon);
-    if(r < 0) {
-        failwith("udev_monitor_enable_receiving");
+    x->epfd = epoll_create1(EPOLL_CLOEXEC);
+    CHECK(x->epfd, "epoll_create1");
+
+    x->sources = calloc(5 + 3 * x->n, sizeof(*x->sources));
+    CHECK_MALLOC(x->sources);
+
+    loop_add(x, PRIO_SIGNAL, signalfd_fd(x), NULL,
+             signalfd_handle_event, NULL);
+    loop_add(x, PRIO_BACKGROUND, udev_fd(x), NULL, udev_handle_event, NULL);
+    loop_add(x, PRIO_BACKGROUND, rules_watch_fd(x), NULL,
+             rules_watch_handle_event, NULL);
+    loop_add(x, PRIO_BACKGROUND, subscribers_fd(x), NULL,
+             subscribers_accept, NULL);
+    if(subscribers_fd(x) >= 0) {
+        // registered with each client's socket while it has a backlog
+        struct source* s = x->subs.writable = &x->sources[x->n_sources++];
+        *s = (struct source) {
+            .prio = PRIO_BACKGROUND, .fd = -1, .shared = subscribers_writable,
+        };
+    }
+    for(size_t i = 0; i < x->n; i++) {
+        struct state* st = &x->displays[i];
+        loop_add(x, PRIO_FOCUS, x11_fd(st), st, NULL, x11_handle_event);
+        loop_add(x, PRIO_SETTLE, timerfd_fd(st), st, NULL, timerfd_ticks);
+        loop_add(x, PRIO_BACKGROUND, cursor_idle_fd(st), st, NULL,
+                 cursor_idle_tick);
     }
 }
 
-static int udev_fd(const struct state* st)
+static void loop_deinit(struct xhook* x)
 {
-    int fd = udev_monitor_get_fd(st->udev_mon);
-    if(fd < 0) {
-        failwith("udev_monitor_get_fd");
-    }
-    return fd;
+    x->subs.writable = NULL;
+    free(x->sources);
+    x->sources = NULL;
+    x->n_sources = 0;
+
+    int r = close(x->epfd); CHECK(r, "close");
+    x->epfd = -1;
 }
 
-static void udev_handle_event(struct state* st)
+// wait for and service the ready descriptors, then the run queue: anything
+// left over when the budget runs out waits for the next iteration, which
+// polls without blocking so that focus changes are seen first
+static void loop_iteration(struct xhook* x)
 {
-    struct udev_device* d = udev_monitor_receive_device(st->udev_mon);
-    if(d == NULL) {
-        failwith("udev_monitor_receive_device");
-    }
-
-    const char* action = udev_device_get_property_value(d, "ACTION");
-    if(action == NULL) {
-        debug("udev: event with action == NULL");
-        return;
-    } else if(strcmp(action, "add") != 0) {
-        debug("udev; ignoring non-add event: %s", action);
+    struct epoll_event es[16];
+    int n = epoll_wait(x->epfd, es, LENGTH(es), x->runq.n > 0 ? 0 : -1);
+    if(n == -1 && errno == EINTR) {
         return;
     }
+    CHECK(n, "epoll_wait");
 
-    const char* kbd = udev_device_get_property_value(d, "ID_INPUT_KEYBOARD");
-    if(kbd == NULL) {
-        debug("udev; ignoring non keyboard event (empty)");
-        return;
-    } else if(strcmp(kbd, "1") != 0) {
-        debug("udev; ignoring non keyboard event (ID_INPUT_KEYBOARD=%s)", kbd);
-        return;
+    // insertion sort by priority, stable so that displays take turns
+    for(int i = 1; i < n; i++) {
+        struct epoll_event e = es[i];
+        int j = i;
+        for(; j > 0 && source_prio(&es[j-1]) > source_prio(&e); j--) {
+            es[j] = es[j-1];
+        }
+        es[j] = e;
     }
 
-    const char* serial = udev_device_get_property_value(d, "ID_SERIAL");
-    info("keyboard added: %s", serial);
+    uint64_t deadline = now_ns() + LOOP_BUDGET_MS * 1000000ULL;
+    for(int i = 0; i < n; i++) {
+        const struct source* s = es[i].data.ptr;
+        // a closed X connection is for Xlib to notice and report
+        const uint32_t ok = s->display == x11_handle_event
+            ? EPOLLIN | EPOLLHUP | EPOLLERR
+            : s == x->subs.writable ? EPOLLOUT | EPOLLHUP | EPOLLERR
+            : EPOLLIN;
+        if(es[i].events & ~ok) {
+            failwith("unhandled epoll events: fd=%d events=%u",
+                     s->fd, es[i].events);
+        }
 
-    debug("resetting layout");
-    st->layout = NULL;
+        // level triggered: skipped sources are reported again
+        if(s->prio >= PRIO_BACKGROUND && now_ns() >= deadline) {
+            debug("over budget: deferring fd %d", s->fd);
+            continue;
+        }
 
-    struct window w;
-    if(x11_window(st, st->active, &w) == 0) {
-        run_hooks(st, &w);
+        if(s->st == NULL) {
+            s->shared(x);
+        } else {
+            s->display(s->st);
+        }
     }
 
-    udev_device_unref(d);
-
-    // TODO: ought one process more than one event here?
+    while(now_ns() < deadline && task_run(x));
 }
 
-static void x11_handle_event(struct state* st)
+static void usage(const char* prog)
 {
-    while(XPending(st->dpy)) {
-        XEvent ev;
-        int r = XNextEvent(st->dpy, &ev);
-        CHECK_IF(r != Success, "XNextEvent");
+    dprintf(2, "usage: %s [-p] [-C] [-r RULES] [-R FILE | -P FILE]"
+            " [-d DISPLAY[=SEAT]]...\n", prog);
+    dprintf(2, "  -p  poll the input focus even with an EWMH window manager\n");
+    dprintf(2, "  -C  disable the window cache\n");
+    dprintf(2, "  -r  read the rules from RULES, reloaded when changed\n");
+    dprintf(2, "  -d  track DISPLAY, using the keyboards of SEAT (seat0)\n");
+    dprintf(2, "      default: $DISPLAY\n");
+    dprintf(2, "  -R  record the focus events and replies to FILE\n");
+    dprintf(2, "  -P  replay FILE without a display, hooks are not run\n");
+}
 
-        if(ev.type == FocusIn) {
-            trace("focus in event: %lu", ev.xfocus.window);
-        } else if(ev.type == FocusOut) {
-            check_focus(st);
-        } else {
-            warning("ignored event: type=%d", ev.type);
-        }
+// connect and send the startup requests, answered by display_start
+static void display_init(struct state* st)
+{
+    stats_init(st);
+    st->errors = calloc(1, sizeof(*st->errors));
+    CHECK_MALLOC(st->errors);
+    timerfd_init(st);
+    if(x11_init(st) != 0) {
+        failwith("unable to open display: %s", XDisplayName(st->name));
     }
 }
 
-static int signalfd_init(struct state* st)
+static void display_start(struct state* st)
 {
-    sigset_t m;
-    sigemptyset(&m);
-    sigaddset(&m, SIGINT);
-    sigaddset(&m, SIGTERM);
+    x11_init_atoms(st);
+    xkb_init(st);
+    pid_cache_init(st);
+    window_cache_init(st);
+    decision_cache_init(st);
+    hook_env_init(st);
+    xi_init(st);
+    cursor_idle_init(st);
+    status_init(st);
 
-    int fd = st->sfd = signalfd(-1, &m, 0);
-    CHECK(fd, "signalfd");
+    focus_mode_update(st);
+    focus_initial(st);
+}
 
-    int r = sigprocmask(SIG_BLOCK, &m, NULL);
-    CHECK(r, "sigprocmask");
+#define RECONNECT_MS 1000
 
-    set_blocking(fd, 0);
+// the connection is gone, and with it everything the server knew: window
+// ids, atoms and keymaps. What xhook worked out from them stays: rules,
+// symbols, decisions, the status and subscribers
+static void display_lost(struct state* st)
+{
+    warning("%s: reconnecting every %ums", XDisplayString(st->dpy),
+            RECONNECT_MS);
+    st->lost = 2;
 
-    return fd;
+    // closed along with the display once a new connection is up
+    loop_replace(st->x, st, x11_handle_event, -1);
+    task_cancel(st);
+
+    window_cache_deinit(st);
+    window_cache_init(st);
+    xkb_deinit(st);
+    memset(&st->history, 0, sizeof(st->history));
+    st->focus.burst = 0;
+    st->active = None;
+    st->cursor.window = st->cursor.root = None;
+    st->cursor.hidden = 0;
+    reset_layout(st);
+    status_window(st, NULL);
+
+    st->ewmh = -1;
+    timerfd_start(st, RECONNECT_MS);
 }
 
-static int signalfd_fd(const struct state* st)
+static void display_reconnect(struct state* st)
 {
-    return st->sfd;
+    if(x11_init(st) != 0) {
+        debug("unable to open display: %s", XDisplayName(st->name));
+        return;
+    }
+    st->lost = 0;
+    st->stats->reconnects += 1;
+    // the serials of the old connection mean nothing on the new one
+    memset(st->errors->quiet, 0, sizeof(st->errors->quiet));
+    st->errors->next = 0;
+    timerfd_stop(st);
+
+    x11_init_atoms(st);
+    xkb_init(st);
+    xi_init(st);
+    if(cursor_idle_fd(st) >= 0) {
+        cursor_idle_select(st);
+    }
+    loop_replace(st->x, st, x11_handle_event, x11_fd(st));
+    info("reconnected to %s", XDisplayString(st->dpy));
+
+    focus_mode_update(st);
+    focus_recheck(st);
 }
 
-static void signalfd_deinit(struct state* st)
+static void display_deinit(struct state* st)
 {
-    int r = close(st->sfd); CHECK(r, "close");
-    st->sfd = -1;
+    status_deinit(st);
+    cursor_idle_deinit(st);
+    hook_env_deinit(st);
+    decision_cache_deinit(st);
+    window_cache_deinit(st);
+    pid_cache_deinit(st);
+    xkb_deinit(st);
+    if(st->dpy != NULL) {
+        x11_deinit(st);
+    }
+    free(st->errors);
+    st->errors = NULL;
+    timerfd_deinit(st);
+    stats_deinit(st);
 }
 
-static void signalfd_handle_event(struct state* st)
+// replaying: the displays of the recording, fed no event but its own
+static void replay_init(struct xhook* x, const struct state* proto,
+                        const char* path)
 {
-    while(1) {
-        struct signalfd_siginfo si;
+    struct replay* r = calloc(1, sizeof(*r));
+    CHECK_MALLOC(r);
+    r->path = path;
+    r->f = fopen(path, "re");
+    if(r->f == NULL) {
+        failwith("unable to open %s: %s", path, strerror(errno));
+    }
 
-        ssize_t s = read(st->sfd, &si, sizeof(si));
-        if(s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            break;
+    struct rec_header h;
+    struct rec_file fh;
+    if(fread(&h, sizeof(h), 1, r->f) != 1 || h.type != REC_HEADER
+       || h.len != sizeof(fh) || fread(&fh, sizeof(fh), 1, r->f) != 1
+       || fh.magic != REC_MAGIC) {
+        failwith("%s: not a recording", path);
+    } else if(fh.version != REC_VERSION) {
+        failwith("%s: unsupported version: %u", path, fh.version);
+    } else if(fh.n_displays == 0 || fh.n_displays > UINT8_MAX) {
+        failwith("%s: invalid number of displays: %u", path,
+                 fh.n_displays);
+    }
+
+    r->n = fh.n_displays;
+    r->displays = calloc(r->n, sizeof(*r->displays));
+    CHECK_MALLOC(r->displays);
+    x->replay = r;
+
+    // main set the options, knowing nothing of the recorded displays
+    const struct state given = x->displays[0];
+    free(x->displays);
+    x->n = r->n;
+    x->displays = calloc(x->n, sizeof(*x->displays));
+    CHECK_MALLOC(x->displays);
+    for(size_t i = 0; i < x->n; i++) {
+        struct state* st = &x->displays[i];
+        *st = *proto;
+        st->opts = given.opts;
+        st->ewmh = 1; // the recorded focus events are all there is
+#if USE_XI
+        st->cursor.tfd = -1;
+#endif
+
+        stats_init(st);
+        st->errors = calloc(1, sizeof(*st->errors));
+        CHECK_MALLOC(st->errors);
+        timerfd_init(st);
+
+        // the recording's types are symbols
+        const char** types;
+        size_t n = window_filter_types(&types);
+        Atom as[SKIP_TYPES_MAX];
+        for(size_t j = 0; j < n; j++) {
+            as[j] = sym_intern(x->syms, STR(types[j]));
         }
-        CHECK(s, "read");
+        window_filter_init(st, as, n);
+        pid_cache_init(st);
+        window_cache_init(st);
+        decision_cache_init(st);
+        st->stats->ready = now_ns();
+    }
+}
 
-        if(s != sizeof(si)) {
-            failwith("unexpected partial read");
+static void replay_deinit(struct xhook* x)
+{
+    struct replay* r = x->replay;
+    for(size_t i = 0; i < x->n; i++) {
+        display_deinit(&x->displays[i]);
+
+        for(size_t j = 0; j < REPLAY_BUCKETS; j++) {
+            struct replay_window* e = r->displays[i].buckets[j];
+            while(e != NULL) {
+                struct replay_window* next = e->next;
+                free(e->name);
+                free(e);
+                e = next;
+            }
         }
+    }
 
-        if(si.ssi_signo == SIGINT) {
-            debug("SIGINT");
-            st->running = 0;
-        } else if(si.ssi_signo == SIGTERM) {
-            debug("SIGTERM");
-            st->running = 0;
-        } else {
-            warning("unhandled signal: %u", si.ssi_signo);
+    free(r->displays);
+    if(fclose(r->f) != 0) {
+        failwith("fclose(%s): %s", r->path, strerror(errno));
+    }
+    free(r);
+    x->replay = NULL;
+}
+
+// the next record into r->h and r->buf, 0 at the end of the recording
+static int replay_read(struct replay* r)
+{
+    if(fread(&r->h, sizeof(r->h), 1, r->f) != 1) {
+        if(ferror(r->f)) {
+            failwith("unable to read %s", r->path);
         }
+        return 0;
+    }
+
+    if(r->h.display >= r->n) {
+        failwith("%s: record for display %u of %zu", r->path,
+                 r->h.display, r->n);
+    } else if(r->h.len > sizeof(r->buf)) {
+        failwith("%s: record too long: %u", r->path, r->h.len);
+    } else if(r->h.len > 0 && fread(r->buf, r->h.len, 1, r->f) != 1) {
+        failwith("%s: truncated record", r->path);
     }
+    return 1;
 }
 
-static void timespec_from_ms(struct timespec* ts, unsigned int ms)
+static void replay_payload(const struct replay* r, void* p, size_t n)
 {
-    unsigned int s = ts->tv_sec = ms / 1000;
-    ms -= s * 1000;
-    ts->tv_nsec = ms * 1000000;
+    if(r->h.len != n) {
+        failwith("%s: record of type %u with a %u byte payload", r->path,
+                 r->h.type, r->h.len);
+    }
+    memcpy(p, r->buf, n);
 }
 
-static void timerfd_init(struct state* st)
+// the NUL terminated string at *i, advanced past it
+static const char* replay_str(const struct replay* r, size_t* i)
 {
-    st->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-    CHECK(st->tfd, "timerfd_create");
+    const char* s = r->buf + *i;
+    const char* e = memchr(s, '\0', r->h.len - *i);
+    if(*i >= r->h.len || e == NULL) {
+        failwith("%s: malformed window record", r->path);
+    }
+    *i += e - s + 1;
+    return s;
 }
 
-static void timerfd_start(struct state* st, unsigned int period_ms)
+static void replay_file_window(struct xhook* x, struct replay_display* d)
 {
-    struct timespec period;
-    timespec_from_ms(&period, period_ms);
+    struct replay* r = x->replay;
+    struct rec_window rw;
+    if(r->h.len < sizeof(rw)) {
+        failwith("%s: truncated window record", r->path);
+    }
+    memcpy(&rw, r->buf, sizeof(rw));
+    if(rw.n_class > MAX_CLASS) {
+        failwith("%s: window %lu with %u classes", r->path,
+                 (unsigned long)rw.window, rw.n_class);
+    }
 
-    struct itimerspec its = {
-        .it_interval = period,
-        .it_value = period,
-    };
-    int r = timerfd_settime(st->tfd, 0, &its, NULL);
-    CHECK(r, "timerfd_settime");
+    struct replay_window* e = replay_find(d, rw.window);
+    if(e == NULL) {
+        e = calloc(1, sizeof(*e));
+        CHECK_MALLOC(e);
+        e->window = rw.window;
+        struct replay_window** b = replay_bucket(d, rw.window);
+        e->next = *b;
+        *b = e;
+    }
+
+    e->ok = rw.ok;
+    e->root = rw.root;
+    e->parent = rw.parent;
+    e->n_class = rw.n_class;
+
+    size_t i = sizeof(rw);
+    for(size_t k = 0; k < rw.n_class; k++) {
+        const char* c = replay_str(r, &i);
+        e->class[k] = sym_intern(x->syms, STR(c));
+    }
+    if(!rw.ok || rw.partial) {
+        return; // the name, if any, is that of an earlier reply
+    }
+
+    if(rw.name_len > r->h.len - i) {
+        failwith("%s: malformed window record", r->path);
+    }
+    free(e->name);
+    e->name = strndup(r->buf + i, rw.name_len);
+    CHECK_MALLOC(e->name);
+    i += rw.name_len;
+
+    const char* t = replay_str(r, &i);
+    e->type = *t == '\0' ? None : sym_intern(x->syms, STR(t));
+    const char* exe = replay_str(r, &i);
+    e->exe = *exe == '\0' ? SYM_NONE : sym_intern(x->syms, STR(exe));
+    e->transient = rw.transient;
+    e->named = 1;
 }
 
-static int timerfd_fd(const struct state* st)
+// 1 if the record just read is a reply, filed for the events to come
+static int replay_file(struct xhook* x)
 {
-    return st->tfd;
+    struct replay* r = x->replay;
+    struct replay_display* d = &r->displays[r->h.display];
+    if(r->h.type == REC_CURRENT) {
+        uint64_t w;
+        replay_payload(r, &w, sizeof(w));
+        d->current = w;
+    } else if(r->h.type == REC_WINDOW) {
+        replay_file_window(x, d);
+    } else {
+        return 0;
+    }
+    r->replies += 1;
+    return 1;
 }
 
-static void timerfd_deinit(struct state* st)
+static void replay_event(struct xhook* x, const struct rec_header* h,
+                         const char* p)
 {
-    int r = close(st->tfd); CHECK(r, "close");
-    st->tfd = -1;
+    struct state* st = &x->displays[h->display];
+    uint64_t v[2] = { 0 };
+    uint32_t n = 0;
+    size_t len = h->type == REC_UDEV ? sizeof(n)
+        : h->type == REC_REPARENT ? 2 * sizeof(v[0])
+        : h->type == REC_INVALIDATE || h->type == REC_DESTROY ? sizeof(v[0])
+        : 0;
+    if(h->len != len) {
+        failwith("%s: record of type %u with a %u byte payload",
+                 x->replay->path, h->type, h->len);
+    }
+    memcpy(h->type == REC_UDEV ? (void*)&n : (void*)v, p, len);
+
+    trace("replay: record %u display %u at %luus", h->type, h->display,
+          (unsigned long)(h->t / 1000));
+    if(h->type == REC_FOCUS) {
+        focus_changed(st);
+    } else if(h->type == REC_TICK) {
+        focus_settled(st);
+    } else if(h->type == REC_START) {
+        focus_initial(st);
+    } else if(h->type == REC_CHECK) {
+        focus_recheck(st);
+    } else if(h->type == REC_UDEV) {
+        keyboards_added(st, n);
+    } else if(h->type == REC_INVALIDATE) {
+        window_cache_invalidate(st, v[0]);
+    } else if(h->type == REC_DESTROY) {
+        window_destroyed(st, v[0]);
+    } else if(h->type == REC_REPARENT) {
+        window_reparented(st, v[0], v[1]);
+    } else {
+        warning("replay: skipping record of type %u", h->type);
+        return;
+    }
+    x->replay->events += 1;
+
+    while(task_run(x)) {
+    }
 }
 
-static void timerfd_ticks(struct state* st)
+// the replies follow the event that caused them: read them before
+// dispatching it, so that they are there when asked for
+static void replay_run(struct xhook* x)
 {
-    size_t ticks = 0;
-    while(1) {
-        uint64_t t = 0;
-        ssize_t r = read(st->tfd, &t, sizeof(t));
-        if(r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            break;
+    struct replay* r = x->replay;
+    struct rec_header h;
+    char p[2 * sizeof(uint64_t)];
+
+    int more = replay_read(r);
+    while(more) {
+        if(replay_file(x)) {
+            more = replay_read(r);
+            continue;
         }
-        CHECK(r, "read");
-        if(r != sizeof(t)) {
-            failwith("unexpected partial read");
+
+        h = r->h;
+        memcpy(p, r->buf, MIN(h.len, sizeof(p)));
+        if(h.len > sizeof(p)) {
+            h.len = sizeof(p) + 1; // rejected by replay_event
         }
-        ticks += t;
-    }
-    if(ticks == 0) {
-        failwith("spurious timerfd read");
-    } else if(ticks > 1) {
-        warning("missed timer ticks: %zu", ticks - 1);
+        while((more = replay_read(r)) && replay_file(x)) {
+        }
+        replay_event(x, &h, p);
     }
-
-    trace("tick");
-    check_focus(st);
 }
 
 int main(int argc, char* argv[])
 {
-    struct state st = {
+    struct xhook x = {
         .running = 1,
+        .displays = NULL,
+        .n = 0,
+    };
+
+    const struct state proto = {
+        .x = &x,
+        .name = NULL,
+        .seat = "seat0",
+
         .active = None,
-        .cursor_hidden_for_window = None,
+        .ewmh = -1,
+        .cursor = { .window = None },
 
         .layout = NULL,
+        .focus = { .burst = 0 },
+        .hook = { .pid = 0 },
     };
 
-    signalfd_init(&st);
-    timerfd_init(&st);
-    x11_init(&st);
-    udev_init(&st);
+    int o, poll_opt = 0, no_cache = 0;
+    const char *record = NULL, *replay = NULL;
+    while((o = getopt(argc, argv, "pCr:R:P:d:h")) != -1) {
+        if(o == 'p') {
+            poll_opt = 1;
+        } else if(o == 'C') {
+            no_cache = 1;
+        } else if(o == 'r') {
+            x.rules_file.path = optarg;
+        } else if(o == 'R') {
+            record = optarg;
+        } else if(o == 'P') {
+            replay = optarg;
+        } else if(o == 'd') {
+            x.displays = realloc(x.displays, (x.n + 1) * sizeof(*x.displays));
+            CHECK_MALLOC(x.displays);
 
-    st.active = x11_current_window(&st);
+            struct state* st = &x.displays[x.n++];
+            *st = proto;
+            st->name = optarg;
 
-    struct window w;
-    if(x11_window(&st, st.active, &w) == 0) {
-        run_hooks(&st, &w);
+            char* seat = strchr(optarg, '=');
+            if(seat != NULL) {
+                *seat = 0;
+                st->seat = seat + 1;
+            }
+        } else if(o == 'h') {
+            usage(argv[0]);
+            return 0;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
     }
 
-    timerfd_start(&st, 100);
-    udev_start(&st);
+    if(optind != argc || (record != NULL && replay != NULL)) {
+        usage(argv[0]);
+        return 1;
+    }
 
-    struct pollfd fds[] = {
-        { .fd = signalfd_fd(&st), .events = POLLIN },
-        { .fd = timerfd_fd(&st), .events = POLLIN },
-        { .fd = x11_fd(&st), .events = POLLIN },
-        { .fd = udev_fd(&st), .events = POLLIN },
-    };
+    if(x.n == 0) {
+        x.displays = malloc(sizeof(*x.displays));
+        CHECK_MALLOC(x.displays);
+        x.displays[x.n++] = proto;
+    }
 
-    while(st.running) {
-        int r = poll(fds, LENGTH(fds), -1);
-        CHECK(r, "poll");
+    for(size_t i = 0; i < x.n; i++) {
+        x.displays[i].opts.poll = poll_opt;
+        x.displays[i].opts.no_cache = no_cache;
+    }
 
-        if(fds[0].revents & POLLIN) {
-            signalfd_handle_event(&st);
-            fds[0].revents &= ~POLLIN;
-        }
+    x11_errors_xhook = &x;
+    if(replay != NULL) {
+        symbols_init(&x);
+        rules_init(&x);
+        replay_init(&x, &proto, replay);
 
-        if(fds[1].revents & POLLIN) {
-            timerfd_ticks(&st);
-            fds[1].revents &= ~POLLIN;
+        uint64_t t0 = now_ns();
+        replay_run(&x);
+        info("replayed %zu events and %zu replies in %" PRIu64 "us",
+             x.replay->events, x.replay->replies, (now_ns() - t0) / 1000);
+        for(size_t i = 0; i < x.n; i++) {
+            stats_dump(&x.displays[i]);
         }
+        logger_flush();
 
-        if(fds[2].revents & POLLIN) {
-            x11_handle_event(&st);
-            fds[2].revents &= ~POLLIN;
-        }
+        replay_deinit(&x);
+        free(x.displays);
+        rules_deinit(&x);
+        symbols_deinit(&x);
+        return 0;
+    }
+
+    signalfd_init(&x);
+    symbols_init(&x);
+    rules_init(&x);
+    rules_watch_init(&x);
+    subscribers_init(&x);
+    if(record != NULL) {
+        rec_open(&x, record);
+    }
+    for(size_t i = 0; i < x.n; i++) {
+        display_init(&x.displays[i]);
+    }
+    udev_init(&x); // while the servers intern the atoms
+    for(size_t i = 0; i < x.n; i++) {
+        display_start(&x.displays[i]);
+    }
+    udev_start(&x);
+
+    for(size_t i = 0; i < x.n; i++) {
+        struct stats* s = x.displays[i].stats;
+        s->ready = now_ns();
+        info("%s ready after %" PRIu64 "us",
+             XDisplayString(x.displays[i].dpy), (s->ready - s->start) / 1000);
+    }
 
-        if(fds[3].revents & POLLIN) {
-            udev_handle_event(&st);
-            fds[3].revents &= ~POLLIN;
+    loop_init(&x);
+
+    while(x.running) {
+        for(size_t i = 0; i < x.n; i++) {
+            if(x.displays[i].lost == 1) {
+                display_lost(&x.displays[i]);
+            }
         }
 
-        for(size_t i = 0; i < LENGTH(fds); i++) {
-            if(fds[i].revents != 0) {
-                failwith("unhandled poll events: "
-                         "fds[%zu] = { .fd = %d, .revents = %hd }",
-                         i, fds[i].fd, fds[i].revents);
+        // events read by Xlib during round trips never reach the socket again
+        int queued = 0;
+        for(size_t i = 0; i < x.n; i++) {
+            if(!x.displays[i].lost && XQLength(x.displays[i].dpy) > 0) {
+                x11_handle_event(&x.displays[i]);
+                queued = 1;
             }
         }
+        if(queued) {
+            continue;
+        }
+
+        for(size_t i = 0; i < x.n; i++) {
+            XFlush(x.displays[i].dpy);
+        }
+        logger_flush();
+
+        loop_iteration(&x);
     }
 
     debug("graceful shutdown");
-    udev_deinit(&st);
-    x11_deinit(&st);
-    signalfd_deinit(&st);
-    timerfd_deinit(&st);
+    for(size_t i = 0; i < x.n; i++) {
+        stats_dump(&x.displays[i]);
+    }
+    loop_deinit(&x);
+    udev_deinit(&x);
+    for(size_t i = 0; i < x.n; i++) {
+        display_deinit(&x.displays[i]);
+    }
+    free(x.displays);
+    rec_close(&x);
+    subscribers_deinit(&x);
+    rules_watch_deinit(&x);
+    rules_deinit(&x);
+    symbols_deinit(&x);
+    signalfd_deinit(&x);
 
     return 0;
 }